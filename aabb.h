@@ -17,14 +17,34 @@ public:
         return { mid - radius, mid + radius };
     }
 
+    static AABB from_corners(Point3 min, Point3 max) {
+        return { min, max };
+    }
+
     bool empty() const {
         return min.x >= max.x || min.y >= max.y || min.z >= max.z;
     }
 
+    const Point3& get_min() const {
+        return min;
+    }
+
+    const Point3& get_max() const {
+        return max;
+    }
+
     Vec3 get_size() const {
         return max - min;
     }
 
+    float surface_area() const {
+        if (empty()) {
+            return 0;
+        }
+        const Vec3 size = get_size();
+        return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
     bool contains(const Point3& point) const {
         return min.x <= point.x && min.y <= point.y && min.z <= point.z
             && point.x <= max.x && point.y <= max.y && point.z <= max.z;
@@ -47,17 +67,28 @@ public:
         }
     }
 
-    bool intersects(const Ray& ray) const {
+    void merge_point(const Point3& point) {
+        min = ::min(min, point);
+        max = ::max(max, point);
+    }
+
+    // Returns the distance at which the ray enters the box, or INFINITY if
+    // it misses the box or the box lies entirely outside [0, tmax].
+    float intersect(const Ray& ray, float tmax = INFINITY) const {
         const Vec3 v1 = min - ray.origin;
         const Vec3 v2 = max - ray.origin;
 
         const Vec3 t1 = v1 * ray.inverted_direction;
         const Vec3 t2 = v2 * ray.inverted_direction;
 
-        const Vec3 tmin = ::min(t1, t2), tmax = ::max(t1,t2);
+        const Vec3 tnear = ::min(t1, t2), tfar = ::max(t1,t2);
 
-        return std::min(tmax.x, std::min(tmax.y, tmax.z)) >=
-            std::max(tmin.x, std::max(tmin.y, tmin.z));
+        const float enter = std::max(tnear.x, std::max(tnear.y, tnear.z));
+        const float exit = std::min(tfar.x, std::min(tfar.y, tfar.z));
+        if (exit >= enter && exit >= 0 && enter <= tmax) {
+            return enter;
+        }
+        return INFINITY;
     }
 
     friend std::ostream& operator<<(std::ostream& os, const AABB& aabb) {
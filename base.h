@@ -1,8 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cerrno>
 #include <cfloat>
+#include <climits>
 #include <cmath>
+#include <cstdlib>
 #include <iostream>
 #include <vector>
 
@@ -19,3 +23,65 @@ T radians(const T& deg)
 }
 
 #define NOINLINE __attribute__((noinline))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// Non-owning view of a contiguous array, like C++20's std::span.
+template <typename T>
+class ArrayRef {
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    ArrayRef() = default;
+    ArrayRef(const T* data, size_t size): data_(data), size_(size) {}
+    ArrayRef(const std::vector<T>& v): data_(v.data()), size_(v.size()) {}
+
+    const T* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+    const T& operator[](size_t i) const { return data_[i]; }
+};
+
+// Parse all of s as a number into out, raised to min if it is below it.
+// Returns false, leaving out alone, if s isn't a number or is out of range.
+inline bool parse_number(const char* s, long& out, long min = LONG_MIN) {
+    char* end;
+    errno = 0;
+    const long value = strtol(s, &end, 10);
+    if (end == s || *end || errno == ERANGE) {
+        return false;
+    }
+    out = std::max(value, min);
+    return true;
+}
+
+inline bool parse_number(const char* s, int& out, int min = INT_MIN) {
+    long value;
+    if (!parse_number(s, value, min) || value > INT_MAX) {
+        return false;
+    }
+    out = value;
+    return true;
+}
+
+inline bool parse_number(const char* s, double& out, double min = -DBL_MAX) {
+    char* end;
+    errno = 0;
+    const double value = strtod(s, &end);
+    if (end == s || *end || errno == ERANGE) {
+        return false;
+    }
+    out = std::max(value, min);
+    return true;
+}
+
+inline bool parse_number(const char* s, float& out, float min = -FLT_MAX) {
+    double value;
+    if (!parse_number(s, value, min) || value > FLT_MAX) {
+        return false;
+    }
+    out = value;
+    return true;
+}
@@ -1,13 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <chrono>
+#include <type_traits>
+#include <vector>
 
 static double ns()
 {
     return std::chrono::nanoseconds(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+// func may return the nanoseconds it took itself, to leave out work that
+// shouldn't count, or nothing to be timed from outside.
 template <typename F>
 double bench(F&& func)
 {
@@ -17,14 +23,19 @@ double bench(F&& func)
     const double min_elapsed = 1e9;
     while (elapsed < min_elapsed)
     {
-        double start_time = ns();
         iters = next_iters;
-        for (size_t i = 0; i < iters; i++) {
-            func();
+        if constexpr (std::is_void_v<std::invoke_result_t<F&>>) {
+            double start_time = ns();
+            for (size_t i = 0; i < iters; i++) {
+                func();
+            }
+            elapsed = ns() - start_time;
+        } else {
+            elapsed = 0;
+            for (size_t i = 0; i < iters; i++) {
+                elapsed += func();
+            }
         }
-
-        double end_time = ns();
-        elapsed = end_time - start_time;
         next_iters = iters * 2;
     }
 
@@ -32,3 +43,70 @@ double bench(F&& func)
     return elapsed / iters;
 }
 
+struct BenchSettings {
+    // Untimed calls first, to settle caches, page faults and clock speed.
+    double warmup = 0.1e9;
+    // Calls are timed in groups that take at least this long, so that the
+    // clock's resolution doesn't matter.
+    double min_sample = 1e6;
+    // Keep taking samples until both of these are reached.
+    double min_time = 0.5e9;
+    size_t min_samples = 10;
+};
+
+// Distribution of the time per call over the samples, in nanoseconds.
+struct BenchStats {
+    size_t samples = 0;
+    size_t calls_per_sample = 0;
+    double mean = 0;
+    double min = 0;
+    double median = 0;
+    double p10 = 0;
+    double p90 = 0;
+    double p99 = 0;
+};
+
+// Percentile p (0 to 100) of sorted values, interpolating between them.
+inline double percentile(const std::vector<double>& sorted, double p)
+{
+    const double rank = p / 100 * (sorted.size() - 1);
+    const size_t below = size_t(rank);
+    const size_t above = std::min(below + 1, sorted.size() - 1);
+    return sorted[below] + (rank - below) * (sorted[above] - sorted[below]);
+}
+
+template <typename F>
+BenchStats bench_stats(F&& func, const BenchSettings& settings = {})
+{
+    size_t warmup_calls = 0;
+    const double warmup_start = ns();
+    while (warmup_calls == 0 || ns() - warmup_start < settings.warmup) {
+        func();
+        warmup_calls++;
+    }
+    const double per_call = (ns() - warmup_start) / warmup_calls;
+
+    BenchStats stats;
+    stats.calls_per_sample = std::max(1.0, std::ceil(settings.min_sample / per_call));
+    std::vector<double> samples;
+    const double start = ns();
+    while (samples.size() < settings.min_samples || ns() - start < settings.min_time) {
+        const double sample_start = ns();
+        for (size_t i = 0; i < stats.calls_per_sample; i++) {
+            func();
+        }
+        samples.push_back((ns() - sample_start) / stats.calls_per_sample);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    stats.samples = samples.size();
+    for (double sample : samples) {
+        stats.mean += sample / samples.size();
+    }
+    stats.min = samples.front();
+    stats.median = percentile(samples, 50);
+    stats.p10 = percentile(samples, 10);
+    stats.p90 = percentile(samples, 90);
+    stats.p99 = percentile(samples, 99);
+    return stats;
+}
@@ -0,0 +1,411 @@
+#include "bench.h"
+#include "progressive.h"
+#include "scene.h"
+#include "wavefront.h"
+
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+// Kernel micro-benchmarks. Each one times a call that processes `items`
+// things (rays, numbers, hits), and reports the time per call and the
+// throughput.
+
+struct Benchmark {
+    const char* name;
+    // What the throughput counts.
+    const char* unit;
+    double items;
+    std::function<void()> run;
+};
+
+struct Result {
+    const Benchmark* benchmark;
+    BenchStats stats;
+
+    double items_per_second() const {
+        return benchmark->items / (stats.median * 1e-9);
+    }
+};
+
+// Keeps the compiler from optimizing away a result.
+template <typename T>
+static void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+constexpr size_t RAYS = 65536;
+constexpr int FRAME_WIDTH = 160, FRAME_HEIGHT = 100;
+constexpr int FRAME_SAMPLES = 4;
+
+// Rays from inside the unit sphere in every direction.
+static std::vector<Ray> random_rays(size_t count, float spread, Random& rng) {
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        rays.emplace_back(spread * random_in_unit_sphere(rng), random_unit_vector(rng), Vec3(1, 1, 1));
+    }
+    return rays;
+}
+
+// Camera rays for a small image, in scanline order with neighbouring
+// samples next to each other, like the renderer shoots them.
+static std::vector<Ray> camera_rays(const Scene<Shape>& scene, int samples) {
+    std::vector<Ray> rays;
+    Random rng(1);
+    for (int y = 0; y < FRAME_HEIGHT; y++) {
+        for (int x = 0; x < FRAME_WIDTH; x++) {
+            for (int i = 0; i < samples; i++) {
+                const float u = (x + rng.uniform()) / (FRAME_WIDTH - 1);
+                const float v = (FRAME_HEIGHT - 1 - y + rng.uniform()) / (FRAME_HEIGHT - 1);
+                rays.push_back(scene.camera.shoot_ray(u, v, rng.uniform(), rng.uniform()));
+            }
+        }
+    }
+    return rays;
+}
+
+// Hits on random surfaces, for the material kernels.
+static ShadeBatch random_hits(size_t count, Random& rng) {
+    ShadeBatch batch;
+    for (size_t i = 0; i < count; i++) {
+        HitRecord hit;
+        hit.p = random_in_unit_sphere(rng);
+        hit.normal = random_unit_vector(rng);
+        hit.front_face = rng.uniform() < 0.5f;
+        Ray ray(Vec3(), random_unit_vector(rng), Vec3(1, 1, 1));
+        if (dot(ray.direction, hit.normal) > 0) {
+            hit.normal = -hit.normal;
+        }
+        const size_t k = batch.add(i, hit, ray);
+        // An albedo of 1 keeps the colors from decaying to denormals over
+        // repeated in-place scatters.
+        batch.ar[k] = batch.ag[k] = batch.ab[k] = 1.0f;
+        batch.param[k] = 1.5f;
+    }
+    batch.fill_random(rng, false);
+    return batch;
+}
+
+static std::vector<Benchmark> make_benchmarks() {
+    std::vector<Benchmark> benchmarks;
+    Random rng(42);
+
+    // Shared by the scene benchmarks, built once.
+    static Scene<Shape> scene = generate_scene(FRAME_WIDTH, FRAME_HEIGHT);
+    scene.Finish(BVHSplit::SAH);
+
+    const auto rays = std::make_shared<std::vector<Ray>>(random_rays(RAYS, 1, rng));
+    const Sphere sphere{ { 0, 0, 2 }, 1.0f };
+    benchmarks.push_back({ "sphere", "rays", RAYS, [=]() {
+        HitRecord hit;
+        for (const Ray& ray : *rays) {
+            hit.distance = INFINITY;
+            sphere.intersect(ray, hit, 0);
+        }
+        keep(hit);
+    }});
+
+    auto packets = std::make_shared<std::vector<Rays<16>>>(RAYS / 16);
+    for (size_t i = 0; i < RAYS; i++) {
+        (*packets)[i / 16].set(i % 16, (*rays)[i]);
+    }
+    benchmarks.push_back({ "sphere_packet", "rays", RAYS, [=]() {
+        Hits<16> hits;
+        for (const auto& packet : *packets) {
+            hits.reset();
+            sphere.intersect(packet, hits, 0);
+            keep(hits);
+        }
+    }});
+
+    const AABB box = AABB::centered({ 0, 0, 2 }, 1);
+    benchmarks.push_back({ "aabb_slab", "rays", RAYS, [=]() {
+        float sum = 0;
+        for (const Ray& ray : *rays) {
+            sum += box.intersect(ray) != INFINITY;
+        }
+        keep(sum);
+    }});
+
+    // Rays from all over the scene in random directions: incoherent, like
+    // the bounces after the first.
+    auto scene_rays = std::make_shared<std::vector<Ray>>();
+    for (size_t i = 0; i < RAYS; i++) {
+        const Point3 origin(24 * rng.uniform() - 12, 3 * rng.uniform(), 24 * rng.uniform() - 12);
+        scene_rays->emplace_back(origin, random_unit_vector(rng), Vec3(1, 1, 1));
+    }
+    benchmarks.push_back({ "bvh_random", "rays", RAYS, [=]() {
+        HitRecord hit;
+        for (const Ray& ray : *scene_rays) {
+            hit = HitRecord{};
+            scene.Intersect(hit, ray);
+        }
+        keep(hit);
+    }});
+
+    benchmarks.push_back({ "bvh_occluded", "rays", RAYS, [=]() {
+        size_t blocked = 0;
+        for (const Ray& ray : *scene_rays) {
+            blocked += scene.Occluded(ray, 4);
+        }
+        keep(blocked);
+    }});
+
+    const auto primary = std::make_shared<std::vector<Ray>>(camera_rays(scene, 1));
+    benchmarks.push_back({ "bvh_coherent", "rays", double(primary->size()), [=]() {
+        HitRecord hit;
+        for (const Ray& ray : *primary) {
+            hit = HitRecord{};
+            scene.Intersect(hit, ray);
+        }
+        keep(hit);
+    }});
+
+    const auto subpixel = std::make_shared<std::vector<Ray>>(camera_rays(scene, 16));
+    benchmarks.push_back({ "bvh_packet", "rays", double(subpixel->size()), [=]() {
+        HitRecord hits[16];
+        for (size_t i = 0; i < subpixel->size(); i += 16) {
+            scene.Intersect<16>(&(*subpixel)[i], 16, hits);
+        }
+        keep(hits);
+    }});
+
+    auto numbers = std::make_shared<std::vector<float>>(RAYS);
+    benchmarks.push_back({ "rng_fill", "numbers", RAYS, [=]() mutable {
+        static Random generator(7);
+        generator.fill(numbers->data(), numbers->size());
+        keep((*numbers)[0]);
+    }});
+
+    const auto sampler = std::make_shared<Sampler>(SamplerType::Sobol, 0xdeadbeef, 256);
+    benchmarks.push_back({ "sampler_sobol", "numbers", 2 * RAYS, [=]() {
+        float sum = 0;
+        for (uint32_t i = 0; i < RAYS; i++) {
+            const Vec2 v = sampler->get2(sampler->sample_id(i % 256, i / 256, i % 64), i % 8);
+            sum += v.x + v.y;
+        }
+        keep(sum);
+    }});
+
+    // The kernels scatter in place, so the batch drifts from call to call;
+    // that doesn't change the amount of work.
+    constexpr size_t HITS = 4096;
+    auto hits = std::make_shared<ShadeBatch>(random_hits(HITS, rng));
+    benchmarks.push_back({ "scatter_lambertian", "hits", HITS, [=]() {
+        Lambertian::scatter(ShadeBatch::Arrays(*hits), hits->size);
+        keep(hits->dx[0]);
+    }});
+    benchmarks.push_back({ "scatter_metal", "hits", HITS, [=]() {
+        Metal::scatter(ShadeBatch::Arrays(*hits), hits->size);
+        keep(hits->dx[0]);
+    }});
+    benchmarks.push_back({ "scatter_dielectric", "hits", HITS, [=]() {
+        Dielectric::scatter(ShadeBatch::Arrays(*hits), hits->size);
+        keep(hits->dx[0]);
+    }});
+
+    // The whole renderer on one thread: a small image of the default
+    // scene, counted in rays traced.
+    const auto sampler4 = std::make_shared<Sampler>(SamplerType::Sobol, 0xdeadbeef, FRAME_SAMPLES);
+    auto integrator = std::make_shared<Wavefront<Scene<Shape>>>(scene, *sampler4, 50, 3);
+    auto accum = std::make_shared<std::vector<Accum>>(FRAME_WIDTH * FRAME_HEIGHT);
+    auto render = [=]() {
+        std::fill(accum->begin(), accum->end(), Accum());
+        integrator->reset_stats();
+        Random frame_rng(0xdeadbeef);
+        integrator->render(accum->size(), FRAME_SAMPLES, [&](size_t pixel, int sample) {
+            return sampler4->sample_id(pixel % FRAME_WIDTH, pixel / FRAME_WIDTH, sample);
+        }, [&](const SampleId& id) {
+            const Vec2 jitter = sampler4->get2(id, PIXEL_DIM);
+            const Vec2 lens = sampler4->get2(id, LENS_DIM);
+            const float u = (id.x + jitter.x) * (1.0f / (FRAME_WIDTH - 1));
+            const float v = (FRAME_HEIGHT - 1 - id.y + jitter.y) * (1.0f / (FRAME_HEIGHT - 1));
+            return scene.camera.shoot_ray(u, v, lens.x, lens.y);
+        }, accum->data(), frame_rng);
+        keep((*accum)[0]);
+    };
+    render();
+    benchmarks.push_back({ "render_frame", "rays", double(integrator->get_rays_traced()), render });
+    return benchmarks;
+}
+
+static std::string format_rate(double per_second) {
+    char text[32];
+    if (per_second >= 1e9) {
+        snprintf(text, sizeof(text), "%.2f G", per_second * 1e-9);
+    } else if (per_second >= 1e6) {
+        snprintf(text, sizeof(text), "%.2f M", per_second * 1e-6);
+    } else {
+        snprintf(text, sizeof(text), "%.2f k", per_second * 1e-3);
+    }
+    return text;
+}
+
+static bool write_csv(const char* path, const std::vector<Result>& results) {
+    std::ofstream os(path);
+    os << "name,unit,items,samples,calls_per_sample,mean_ns,min_ns,median_ns,p10_ns,p90_ns,p99_ns,items_per_s\n";
+    for (const auto& result : results) {
+        const BenchStats& s = result.stats;
+        os << result.benchmark->name << "," << result.benchmark->unit << "," << result.benchmark->items << ","
+            << s.samples << "," << s.calls_per_sample << "," << s.mean << "," << s.min << "," << s.median << ","
+            << s.p10 << "," << s.p90 << "," << s.p99 << "," << result.items_per_second() << "\n";
+    }
+    if (!os) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+static bool write_json(const char* path, const std::vector<Result>& results) {
+    std::ofstream os(path);
+    os << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& result = results[i];
+        const BenchStats& s = result.stats;
+        os << "  { \"name\": \"" << result.benchmark->name << "\", \"unit\": \"" << result.benchmark->unit
+            << "\", \"items\": " << result.benchmark->items << ", \"samples\": " << s.samples
+            << ", \"calls_per_sample\": " << s.calls_per_sample << ", \"mean_ns\": " << s.mean
+            << ", \"min_ns\": " << s.min << ", \"median_ns\": " << s.median << ", \"p10_ns\": " << s.p10
+            << ", \"p90_ns\": " << s.p90 << ", \"p99_ns\": " << s.p99
+            << ", \"items_per_s\": " << result.items_per_second() << " }"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "]\n";
+    if (!os) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+// Median time per call of each benchmark in a CSV file written by
+// write_csv.
+static bool read_baseline(const char* path, std::map<std::string, double>& medians) {
+    std::ifstream is(path);
+    if (!is) {
+        perror(path);
+        return false;
+    }
+    std::string line;
+    std::getline(is, line);
+    while (std::getline(is, line)) {
+        std::vector<std::string> fields;
+        std::stringstream ss(line);
+        std::string field;
+        while (std::getline(ss, field, ',')) {
+            fields.push_back(field);
+        }
+        double median;
+        if (fields.size() < 8 || !parse_number(fields[7].c_str(), median)) {
+            fprintf(stderr, "%s: bad line: %s\n", path, line.c_str());
+            return false;
+        }
+        medians[fields[0]] = median;
+    }
+    return true;
+}
+
+static void usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [--list] [--filter TEXT] [--time S] [--json FILE] [--csv FILE]"
+        " [--compare BASELINE.csv] [--tolerance PERCENT]\n";
+}
+
+int main(int argc, const char* argv[]) {
+    bool list = false;
+    std::string filter;
+    BenchSettings settings;
+    const char* json_path = nullptr;
+    const char* csv_path = nullptr;
+    const char* baseline_path = nullptr;
+    double tolerance = 5;
+
+#ifdef __SSE__
+    // Denormals-are-zero and flush-to-zero, as in raytrace, so that kernels
+    // whose values decay don't slow down the longer they run.
+    _mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        // Cleared by options with a value that isn't a number.
+        bool ok = true;
+        if (arg == "--list") {
+            list = true;
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--time" && i + 1 < argc) {
+            double seconds = settings.min_time * 1e-9;
+            ok = parse_number(argv[++i], seconds, 0.0);
+            settings.min_time = seconds * 1e9;
+        } else if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (arg == "--csv" && i + 1 < argc) {
+            csv_path = argv[++i];
+        } else if (arg == "--compare" && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (arg == "--tolerance" && i + 1 < argc) {
+            ok = parse_number(argv[++i], tolerance, 0.0);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    if (baseline_path && !read_baseline(baseline_path, baseline)) {
+        return 1;
+    }
+
+    const auto benchmarks = make_benchmarks();
+    if (list) {
+        for (const auto& benchmark : benchmarks) {
+            std::cout << benchmark.name << "\n";
+        }
+        return 0;
+    }
+
+    printf("%-20s %12s %12s %12s %12s %14s\n", "benchmark", "median us", "p10 us", "p90 us", "p99 us", "throughput");
+    std::vector<Result> results;
+    size_t regressions = 0;
+    for (const auto& benchmark : benchmarks) {
+        if (std::string_view(benchmark.name).find(filter) == std::string_view::npos) {
+            continue;
+        }
+        const Result result = { &benchmark, bench_stats(benchmark.run, settings) };
+        const BenchStats& s = result.stats;
+        printf("%-20s %12.2f %12.2f %12.2f %12.2f %8s%s/s", benchmark.name, s.median * 1e-3, s.p10 * 1e-3,
+               s.p90 * 1e-3, s.p99 * 1e-3, format_rate(result.items_per_second()).c_str(), benchmark.unit);
+        const auto old = baseline.find(benchmark.name);
+        if (old != baseline.end()) {
+            // Positive is faster.
+            const double change = (old->second / s.median - 1) * 100;
+            const bool slower = change < -tolerance;
+            regressions += slower;
+            printf("  %+6.1f%%%s", change, slower ? " SLOWER" : change > tolerance ? " faster" : "");
+        }
+        printf("\n");
+        fflush(stdout);
+        results.push_back(result);
+    }
+
+    if (csv_path && !write_csv(csv_path, results)) {
+        return 1;
+    }
+    if (json_path && !write_json(json_path, results)) {
+        return 1;
+    }
+    if (baseline_path) {
+        printf("%zu of %zu benchmarks more than %g%% slower than %s\n", regressions, results.size(), tolerance,
+               baseline_path);
+    }
+    return regressions ? 2 : 0;
+}
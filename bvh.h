@@ -1,10 +1,16 @@
 #pragma once
 
-#include <optional>
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <string>
+#include <type_traits>
 
 #include "aabb.h"
+#include "rays.h"
+#include "stats.h"
 
-enum class Axis { X, Y, Z };
+enum class Axis : uint8_t { X, Y, Z };
 
 static Axis next_axis(Axis axis) {
     if (axis == Axis::X) return Axis::Y;
@@ -24,15 +30,12 @@ static Axis largest_axis(const AABB& bounds) {
     }
 }
 
-template<typename T>
-bool compare_centers(const T& a, const T& b, Axis axis) {
-    Point3 p1 = a.get_center();
-    Point3 p2 = b.get_center();
+inline float component(const Vec3& v, Axis axis) {
     switch (axis) {
-    case Axis::X: return p1.x < p2.x;
-    case Axis::Y: return p1.y < p2.y;
-    case Axis::Z: return p1.z < p2.z;
-    default: return false;
+    case Axis::X: return v.x;
+    case Axis::Y: return v.y;
+    case Axis::Z: return v.z;
+    default: abort();
     }
 }
 
@@ -45,101 +48,701 @@ inline std::ostream& operator<<(std::ostream& os, Axis axis) {
     }
 }
 
+struct BVHNode {
+    float min[3];
+    // Interior nodes: index of the first of two adjacent children.
+    // Leaves: index of the first item in the BVH's index array.
+    uint32_t offset;
+    float max[3];
+    // Number of items in a leaf, 0 for interior nodes.
+    uint16_t count;
+    Axis axis;
+    // Leaves: how many of the items are tested one at a time instead of in
+    // blocks, see leaf_block.
+    uint8_t singles;
+
+    bool is_leaf() const {
+        return count > 0;
+    }
+
+    AABB get_bounds() const {
+        return AABB::from_corners(load(min), load(max));
+    }
+
+    void set_bounds(const AABB& bounds) {
+        const Point3& lo = bounds.get_min();
+        const Point3& hi = bounds.get_max();
+        min[0] = lo.x; min[1] = lo.y; min[2] = lo.z;
+        max[0] = hi.x; max[1] = hi.y; max[2] = hi.z;
+    }
+
+private:
+    // Load the three floats with one unaligned vector load (the fourth lane
+    // is the offset or count field, masked off). Building the Vec3 from
+    // scalars made traversal several times slower.
+    static Vec3 load(const float* p) {
+        const __m128 mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+        return Vec3(_mm_and_ps(_mm_loadu_ps(p), mask));
+    }
+};
+static_assert(sizeof(BVHNode) == 32);
+
+enum class BVHSplit {
+    // Split at the median item along the largest axis.
+    Median,
+    // Binned surface area heuristic.
+    SAH,
+};
+
+inline std::ostream& operator<<(std::ostream& os, BVHSplit split) {
+    switch (split) {
+    case BVHSplit::Median: return os << "median";
+    case BVHSplit::SAH: return os << "sah";
+    default: return os << static_cast<int>(split);
+    }
+}
+
+// Items with a LEAF_BLOCK are tested that many at a time in the leaves,
+// except for those whose in_leaf_block() is false, which are tested one at
+// a time. A leaf costs as much as its number of blocks and single items.
+template <typename T, typename = void>
+struct leaf_block {
+    static constexpr uint32_t value = 1;
+};
+
+template <typename T>
+struct leaf_block<T, std::void_t<decltype(T::LEAF_BLOCK)>> {
+    static constexpr uint32_t value = T::LEAF_BLOCK;
+};
+
+// Linearized BVH over a vector of items owned by someone else. Nodes are
+// stored depth-first in one array, and leaves refer to ranges of a single
+// array of item indices.
 template <typename T>
 class BVH {
-    Axis axis = Axis::X;
-    std::vector<T> items;
-    AABB bounds;
+    std::vector<BVHNode> node_storage;
+    std::vector<uint32_t> index_storage;
+    // Either the storage above or memory owned by someone else, like a
+    // mapped scene file.
+    ArrayRef<BVHNode> nodes;
+    ArrayRef<uint32_t> indices;
+    // Each node's subtree_costs() when it was built, to tell how much
+    // refitting has degraded it.
+    std::vector<float> built_costs;
+
+    static constexpr uint32_t MAX_LEAF_SIZE = 3;
+    static constexpr uint32_t MAX_SAH_LEAF_SIZE = 8;
+    static constexpr size_t MAX_DEPTH = 64;
+    static constexpr int SAH_BINS = 12;
+    // Relative costs of testing a node's bounds and of testing an item.
+    static constexpr float TRAVERSAL_COST = 1.0f;
+    static constexpr float INTERSECT_COST = 1.0f;
+    static constexpr uint32_t LEAF_BLOCK = leaf_block<T>::value;
+
+    static float items_cost(uint32_t count, uint32_t singles) {
+        return INTERSECT_COST * ((count - singles + LEAF_BLOCK - 1) / LEAF_BLOCK + singles);
+    }
+
+    struct BuildInput {
+        const std::vector<AABB>& bounds;
+        const std::vector<Point3>& centers;
+        BVHSplit split;
+        // Empty if no item is tested on its own.
+        const std::vector<uint8_t>& singles;
+
+        uint32_t is_single(uint32_t item) const {
+            return !singles.empty() && singles[item];
+        }
+    };
+
+    void build(uint32_t index, uint32_t first, uint32_t count, size_t depth,
+               const BuildInput& in) {
+        AABB bounds;
+        AABB centroid_bounds;
+        uint32_t singles = 0;
+        for (uint32_t i = first; i < first + count; i++) {
+            bounds.merge(in.bounds[index_storage[i]]);
+            centroid_bounds.merge_point(in.centers[index_storage[i]]);
+            singles += in.is_single(index_storage[i]);
+        }
+        bounds.expand(0.001f);
+        Axis axis = largest_axis(bounds);
+        uint32_t left_count = 0;
+        // Fall back to median splits near the depth limit, they are
+        // guaranteed to finish before the traversal stack overflows.
+        if (in.split == BVHSplit::SAH && depth < MAX_DEPTH / 2) {
+            left_count = split_sah(first, count, singles, bounds, centroid_bounds, axis, in);
+        } else if (count > MAX_LEAF_SIZE) {
+            left_count = split_median(first, count, axis, in);
+        }
+        node_storage[index].set_bounds(bounds);
+        node_storage[index].axis = axis;
+        if (left_count) {
+            const uint32_t children = node_storage.size();
+            node_storage.resize(children + 2);
+            node_storage[index].offset = children;
+            node_storage[index].count = 0;
+            node_storage[index].singles = 0;
+            build(children, first, left_count, depth + 1, in);
+            build(children + 1, first + left_count, count - left_count, depth + 1, in);
+        } else {
+            node_storage[index].offset = first;
+            node_storage[index].count = count;
+            node_storage[index].singles = singles;
+        }
+    }
+
+    uint32_t split_median(uint32_t first, uint32_t count, Axis axis, const BuildInput& in) {
+        const auto begin = index_storage.begin() + first;
+        const auto mid = begin + count / 2;
+        std::nth_element(begin, mid, begin + count, [&](uint32_t a, uint32_t b) {
+            return component(in.centers[a], axis) < component(in.centers[b], axis);
+        });
+        return count / 2;
+    }
+
+    // Returns the number of items partitioned into the left child, or 0 if
+    // a leaf is cheaper than any split. Updates axis to the chosen one.
+    uint32_t split_sah(uint32_t first, uint32_t count, uint32_t singles, const AABB& bounds,
+                       const AABB& centroid_bounds, Axis& axis, const BuildInput& in) {
+        if (count <= 1) {
+            return 0;
+        }
+        struct Bin {
+            AABB bounds;
+            uint32_t count = 0;
+            uint32_t singles = 0;
+        };
 
-    std::vector<BVH> subvolumes;
+        const float leaf_cost = items_cost(count, singles);
+        float best_cost = INFINITY;
+        Axis best_axis = axis;
+        int best_split = 0;
+        for (Axis a : { Axis::X, Axis::Y, Axis::Z }) {
+            const float lo = component(centroid_bounds.get_min(), a);
+            const float extent = component(centroid_bounds.get_max(), a) - lo;
+            if (!(extent > 0)) {
+                continue;
+            }
+            const float scale = SAH_BINS / extent;
+            Bin bins[SAH_BINS];
+            for (uint32_t i = first; i < first + count; i++) {
+                const uint32_t item = index_storage[i];
+                const int b = std::min(SAH_BINS - 1, int((component(in.centers[item], a) - lo) * scale));
+                bins[b].bounds.merge(in.bounds[item]);
+                bins[b].count++;
+                bins[b].singles += in.is_single(item);
+            }
+
+            // Sweep from the right to get the cost of each right half, then
+            // from the left to combine with each left half.
+            float right_area[SAH_BINS];
+            uint32_t right_count[SAH_BINS];
+            uint32_t right_singles[SAH_BINS];
+            AABB right;
+            uint32_t n = 0;
+            uint32_t s = 0;
+            for (int b = SAH_BINS - 1; b > 0; b--) {
+                right.merge(bins[b].bounds);
+                n += bins[b].count;
+                s += bins[b].singles;
+                right_area[b] = right.surface_area();
+                right_count[b] = n;
+                right_singles[b] = s;
+            }
+            AABB left;
+            n = 0;
+            s = 0;
+            for (int b = 1; b < SAH_BINS; b++) {
+                left.merge(bins[b - 1].bounds);
+                n += bins[b - 1].count;
+                s += bins[b - 1].singles;
+                if (n == 0 || right_count[b] == 0) {
+                    continue;
+                }
+                const float cost = left.surface_area() * items_cost(n, s)
+                    + right_area[b] * items_cost(right_count[b], right_singles[b]);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_split = b;
+                }
+            }
+        }
+
+        if (best_split == 0) {
+            // All centers coincide, any split is as good as another.
+            return count > MAX_SAH_LEAF_SIZE ? split_median(first, count, axis, in) : 0;
+        }
+        best_cost = TRAVERSAL_COST + best_cost / bounds.surface_area();
+        if (best_cost >= leaf_cost && count <= MAX_SAH_LEAF_SIZE) {
+            return 0;
+        }
+
+        axis = best_axis;
+        const float lo = component(centroid_bounds.get_min(), axis);
+        const float scale = SAH_BINS / (component(centroid_bounds.get_max(), axis) - lo);
+        const auto begin = index_storage.begin() + first;
+        const auto mid = std::partition(begin, begin + count, [&](uint32_t item) {
+            return std::min(SAH_BINS - 1, int((component(in.centers[item], axis) - lo) * scale)) < best_split;
+        });
+        return mid - begin;
+    }
 
 public:
     BVH() {}
-    BVH(std::vector<T> in_items):
-        items(std::move(in_items))
+    BVH(const std::vector<T>& items, BVHSplit split = BVHSplit::SAH):
+        BVH(item_bounds(items), item_centers(items), split, item_singles(items)) {}
+
+    // Build from the bounds and center of each item, and item_singles.
+    BVH(const std::vector<AABB>& bounds, const std::vector<Point3>& centers, BVHSplit split = BVHSplit::SAH,
+        const std::vector<uint8_t>& singles = {}):
+        index_storage(bounds.size()), indices(index_storage)
     {
+        if (bounds.empty()) {
+            return;
+        }
+        std::iota(index_storage.begin(), index_storage.end(), 0);
+        node_storage.reserve(2 * bounds.size());
+        node_storage.resize(1);
+        build(0, 0, bounds.size(), 0, { bounds, centers, split, singles });
+        nodes = node_storage;
+        built_costs = subtree_costs();
+    }
+
+    static std::vector<AABB> item_bounds(const std::vector<T>& items) {
+        std::vector<AABB> bounds;
+        bounds.reserve(items.size());
         for (const auto& item : items) {
-            bounds.merge(item.get_bounds());
+            bounds.push_back(item.get_bounds());
         }
-        bounds.expand(0.001f);
-        axis = largest_axis(bounds);
-        if (items.size() > 3) {
-            std::sort(items.begin(), items.end(), [=](const T& a, const T& b) {
-                return compare_centers(a, b, axis);
-            });
-            auto it1 = items.begin();
-            auto it2 = it1 + items.size() / 2;
-            auto it3 = items.end();
-            if (it1 != it2) {
-                subvolumes.emplace_back(std::vector<T>(it1, it2));
+        return bounds;
+    }
+
+    static std::vector<Point3> item_centers(const std::vector<T>& items) {
+        std::vector<Point3> centers;
+        centers.reserve(items.size());
+        for (const auto& item : items) {
+            centers.push_back(item.get_center());
+        }
+        return centers;
+    }
+
+    // 1 for each item that is tested on its own rather than in a block of
+    // LEAF_BLOCK. Empty if there are no blocks.
+    static std::vector<uint8_t> item_singles(const std::vector<T>& items) {
+        std::vector<uint8_t> singles;
+        if constexpr (LEAF_BLOCK > 1) {
+            singles.reserve(items.size());
+            for (const auto& item : items) {
+                singles.push_back(!item.in_leaf_block());
+            }
+        }
+        return singles;
+    }
+
+    // A BVH in memory owned by the caller, which must outlive it. The nodes
+    // must be laid out as built here: depth first, with no more than
+    // MAX_DEPTH levels.
+    BVH(ArrayRef<BVHNode> nodes, ArrayRef<uint32_t> indices):
+        nodes(nodes), indices(indices) {}
+
+    // Moving keeps the vectors' buffers, so the views stay valid. A copy
+    // would still point into the original.
+    BVH(BVH&&) = default;
+    BVH& operator=(BVH&&) = default;
+    BVH(const BVH&) = delete;
+    BVH& operator=(const BVH&) = delete;
+
+    // Whether the nodes are laid out as the traversal expects, and the
+    // indices hold each of the item_count items once. For BVHs read from
+    // files.
+    bool validate(size_t item_count) const {
+        if (nodes.empty()) {
+            return indices.empty();
+        }
+        // Children come after their parent, so depths can be found in one
+        // pass. Each node may only have one parent, or a shallow parent
+        // could hide how deep a shared child really is.
+        std::vector<uint8_t> depth(nodes.size());
+        std::vector<uint8_t> has_parent(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const BVHNode& node = nodes[i];
+            if (node.is_leaf()) {
+                if (size_t(node.offset) + node.count > indices.size() || node.singles > node.count) {
+                    return false;
+                }
+            } else if (node.offset <= i || size_t(node.offset) + 1 >= nodes.size()
+                       || has_parent[node.offset] || has_parent[node.offset + 1]
+                       || depth[i] + 1u >= MAX_DEPTH || static_cast<int>(node.axis) > 2) {
+                return false;
             } else {
-                printf("it1..it2 empty?\n");
+                depth[node.offset] = depth[node.offset + 1] = depth[i] + 1;
+                has_parent[node.offset] = has_parent[node.offset + 1] = 1;
             }
-            if (it2 != it3) {
-                subvolumes.emplace_back(std::vector<T>(it2, it3));
+        }
+        // The indices must be a permutation of the items.
+        if (indices.size() != item_count) {
+            return false;
+        }
+        std::vector<uint8_t> seen(item_count);
+        for (uint32_t i : indices) {
+            if (i >= item_count || seen[i]) {
+                return false;
+            }
+            seen[i] = 1;
+        }
+        return true;
+    }
+
+    // Expected cost of tracing a ray through the tree, relative to the cost
+    // of intersecting one item.
+    float sah_cost() const {
+        if (nodes.empty()) {
+            return 0;
+        }
+        float cost = 0;
+        for (const auto& node : nodes) {
+            const float area = node.get_bounds().surface_area();
+            cost += area * (node.is_leaf() ? items_cost(node.count, node.singles) : TRAVERSAL_COST);
+        }
+        return cost / nodes[0].get_bounds().surface_area();
+    }
+
+    // The SAH cost of each node's subtree, relative to the node's own area.
+    // Children come after their parents, so going backwards reaches every
+    // child before its parent.
+    std::vector<float> subtree_costs() const {
+        std::vector<float> area_costs(nodes.size());
+        std::vector<float> costs(nodes.size());
+        for (size_t i = nodes.size(); i-- > 0;) {
+            const BVHNode& node = nodes[i];
+            const float area = node.get_bounds().surface_area();
+            if (node.is_leaf()) {
+                area_costs[i] = area * items_cost(node.count, node.singles);
             } else {
-                printf("it2..it3 empty?\n");
+                area_costs[i] = area * TRAVERSAL_COST + area_costs[node.offset] + area_costs[node.offset + 1];
             }
+            costs[i] = area > 0 ? area_costs[i] / area : 0;
         }
+        return costs;
     }
 
-    Axis get_axis() const {
-        return axis;
+    // Fit the bounds to items that moved, keeping the tree as it is. O(n),
+    // but the tree gets worse the further the items move from where they
+    // were when it was built; see rebuild_degraded.
+    void refit(const std::vector<AABB>& bounds) {
+        make_owned();
+        if (built_costs.size() != node_storage.size()) {
+            // Not built here, so measure from the tree as it was given.
+            built_costs = subtree_costs();
+        }
+        for (size_t i = node_storage.size(); i-- > 0;) {
+            BVHNode& node = node_storage[i];
+            AABB box;
+            if (node.is_leaf()) {
+                for (uint32_t k = node.offset; k < node.offset + node.count; k++) {
+                    box.merge(bounds[index_storage[k]]);
+                }
+                box.expand(0.001f);
+            } else {
+                box = node_storage[node.offset].get_bounds();
+                box.merge(node_storage[node.offset + 1].get_bounds());
+            }
+            node.set_bounds(box);
+        }
     }
 
-    const AABB& get_bounds() const {
-        return bounds;
+    struct RebuildStats {
+        size_t subtrees = 0;
+        size_t items = 0;
+    };
+
+    // Rebuild the subtrees whose cost has grown past threshold times their
+    // cost when they were built, each from the items already under it. Only
+    // the topmost such subtrees are rebuilt, so this is a full rebuild if
+    // the root has degraded, and close to free if nothing has.
+    RebuildStats rebuild_degraded(const std::vector<AABB>& bounds, const std::vector<Point3>& centers,
+                                  BVHSplit split, float threshold, const std::vector<uint8_t>& singles = {}) {
+        make_owned();
+        RebuildStats stats;
+        if (node_storage.empty()) {
+            return stats;
+        }
+        const std::vector<float> costs = subtree_costs();
+        if (built_costs.size() != node_storage.size()) {
+            built_costs = costs;
+        }
+        // The items under each node are a contiguous range of the indices.
+        const size_t n = node_storage.size();
+        std::vector<uint32_t> first(n), count(n);
+        for (size_t i = n; i-- > 0;) {
+            const BVHNode& node = node_storage[i];
+            if (node.is_leaf()) {
+                first[i] = node.offset;
+                count[i] = node.count;
+            } else {
+                first[i] = first[node.offset];
+                count[i] = count[node.offset] + count[node.offset + 1];
+            }
+        }
+
+        const BuildInput in = { bounds, centers, split, singles };
+        std::vector<uint32_t> rebuilt;
+        struct Entry {
+            uint32_t index;
+            uint32_t depth;
+        };
+        Entry stack[MAX_DEPTH];
+        size_t sp = 0;
+        stack[sp++] = { 0, 0 };
+        while (sp) {
+            const Entry entry = stack[--sp];
+            const BVHNode& node = node_storage[entry.index];
+            if (node.is_leaf()) {
+                continue;
+            }
+            if (costs[entry.index] > threshold * built_costs[entry.index]) {
+                // The new nodes go at the end, and the old ones are dropped
+                // by relayout below.
+                build(entry.index, first[entry.index], count[entry.index], entry.depth, in);
+                rebuilt.push_back(entry.index);
+                stats.subtrees++;
+                stats.items += count[entry.index];
+                continue;
+            }
+            stack[sp++] = { node.offset, entry.depth + 1 };
+            stack[sp++] = { node.offset + 1, entry.depth + 1 };
+        }
+        if (rebuilt.empty()) {
+            return stats;
+        }
+
+        // Rebuilt subtrees are measured from their new costs.
+        nodes = node_storage;
+        const std::vector<float> new_costs = subtree_costs();
+        built_costs.resize(node_storage.size());
+        std::copy(new_costs.begin() + n, new_costs.end(), built_costs.begin() + n);
+        for (uint32_t index : rebuilt) {
+            built_costs[index] = new_costs[index];
+        }
+
+        std::vector<BVHNode> laid_out;
+        std::vector<float> laid_out_costs;
+        laid_out.reserve(node_storage.size());
+        laid_out_costs.reserve(node_storage.size());
+        laid_out.push_back(node_storage[0]);
+        laid_out_costs.push_back(built_costs[0]);
+        relayout(0, 0, laid_out, laid_out_costs);
+        node_storage = std::move(laid_out);
+        built_costs = std::move(laid_out_costs);
+        nodes = node_storage;
+        return stats;
     }
 
-    const std::vector<BVH>& get_subvolumes() const {
-        return subvolumes;
+    ArrayRef<BVHNode> get_nodes() const {
+        return nodes;
     }
 
-    const std::vector<T>& get_items() const {
-        return items;
+    ArrayRef<uint32_t> get_indices() const {
+        return indices;
     }
 
-    bool intersects(const Ray& ray) const {
-        return bounds.intersects(ray);
+    // Closest-hit traversal. Children are visited front to back, and nodes
+    // that start beyond the closest hit found so far are skipped.
+    void intersect(const std::vector<T>& items, const Ray& ray, HitRecord& out) const {
+        traverse(ray, out, [&](const uint32_t* leaf, uint32_t count) {
+            for (uint32_t i = 0; i < count; i++) {
+                items[leaf[i]].intersect(ray, out);
+            }
+        });
     }
 
-    template <typename... Args>
-    void intersect(const Ray& ray, Args&&... args) const {
-        if (!intersects(ray)) {
-            //printf("Skipping %zu objects :)\n", items.size());
-            return;
+    // Any-hit traversal: whether any item is hit closer than tmax.
+    bool occluded(const std::vector<T>& items, const Ray& ray, float tmax) const {
+        HitRecord out;
+        out.distance = tmax;
+        return traverse(ray, out, [&](const uint32_t* leaf, uint32_t count) {
+            for (uint32_t i = 0; i < count; i++) {
+                if (items[leaf[i]].occluded(ray, tmax)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    // Closest-hit traversal that calls leaf(item_indices, count) for each
+    // leaf the ray reaches, for items that are intersected several at a
+    // time. leaf updates out with any closer hit. If leaf returns a bool,
+    // true stops the traversal, for any-hit queries; traverse then returns
+    // whether it was stopped.
+    template <typename F>
+    bool traverse(const Ray& ray, HitRecord& out, F&& leaf) const {
+        if (nodes.empty()) {
+            return false;
         }
-        if (subvolumes.size()) {
-            for (const auto& subvol : subvolumes) {
-                subvol.intersect(ray, std::forward<Args>(args)...);
+        const bool negative[3] = {
+            ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0
+        };
+        StatCounter visited(&RenderStats::nodes_visited);
+        StatCounter tested(&RenderStats::primitive_tests);
+        uint32_t stack[MAX_DEPTH];
+        size_t sp = 0;
+        uint32_t index = 0;
+        while (true) {
+            const BVHNode& node = nodes[index];
+            ++visited;
+            const float tmax = out.is_hit() ? out.distance : INFINITY;
+            if (node.get_bounds().intersect(ray, tmax) != INFINITY) {
+                if (!node.is_leaf()) {
+                    const uint32_t near = negative[static_cast<int>(node.axis)];
+                    stack[sp++] = node.offset + (1 - near);
+                    index = node.offset + near;
+                    continue;
+                }
+                tested += node.count;
+                if constexpr (std::is_same_v<decltype(leaf(indices.data(), 0u)), bool>) {
+                    if (leaf(&indices[node.offset], node.count)) {
+                        return true;
+                    }
+                } else {
+                    leaf(&indices[node.offset], node.count);
+                }
             }
-        } else {
-            //printf("Reached leaf with %zu objects.\n", items.size());
-            for (const auto& item : items) {
-                item.intersect(ray, std::forward<Args>(args)...);
+            if (sp == 0) {
+                break;
             }
+            index = stack[--sp];
         }
+        return false;
     }
 
-    void dump(std::ostream& os, std::string indent) const {
-        os << indent << "{ " << items.size() << " items, axis=" << axis << ", bounds=" << bounds << "\n";
-        std::string indent2 = indent + "  ";
-        if (subvolumes.size()) {
-            os << indent2 << subvolumes.size() << " subvolumes:\n";
-            for (const auto& subvol : subvolumes) {
-                subvol.dump(os, indent2);
+    // Closest-hit traversal for a packet of rays, sharing one walk of the
+    // tree. A node is visited if any lane in the active mask hits it, and
+    // only those lanes stay active in its subtree. Children are ordered by
+    // the direction of the first active lane.
+    template <size_t N>
+    void intersect(const std::vector<T>& items, const Rays<N>& rays, Hits<N>& hits, uint32_t active) const {
+        traverse_packet(rays, hits, active, [&](uint32_t first, uint32_t count) {
+            for (uint32_t i = first; i < first + count; i++) {
+                items[indices[i]].intersect(rays, hits);
+            }
+        });
+    }
+
+    // Packet traversal that calls leaf(first, count) for each leaf any
+    // active lane reaches, with the leaf's range in get_indices().
+    template <size_t N, typename F>
+    void traverse_packet(const Rays<N>& rays, Hits<N>& hits, uint32_t active, F&& leaf) const {
+        static_assert(N <= 32);
+        if (nodes.empty()) {
+            return;
+        }
+        const float* directions[3] = { rays.dx, rays.dy, rays.dz };
+        struct Entry {
+            uint32_t index;
+            uint32_t mask;
+        };
+        StatCounter visited(&RenderStats::nodes_visited);
+        StatCounter tested(&RenderStats::primitive_tests);
+        Entry stack[MAX_DEPTH];
+        size_t sp = 0;
+        Entry entry = { 0, active };
+        while (true) {
+            const BVHNode& node = nodes[entry.index];
+            ++visited;
+            const uint32_t mask = entry.mask & intersect_lanes(node, rays, hits);
+            if (mask) {
+                if (!node.is_leaf()) {
+                    const int lane = __builtin_ctz(mask);
+                    const uint32_t near = directions[static_cast<int>(node.axis)][lane] < 0;
+                    stack[sp++] = { node.offset + (1 - near), mask };
+                    entry = { node.offset + near, mask };
+                    continue;
+                }
+                tested += node.count;
+                leaf(node.offset, node.count);
             }
+            if (sp == 0) {
+                break;
+            }
+            entry = stack[--sp];
+        }
+    }
+
+    void dump(std::ostream& os, const std::vector<T>& items) const {
+        os << "BVH " << nodes.size() << " nodes, " << indices.size() << " items, SAH cost " << sah_cost() << " ";
+        if (nodes.empty()) {
+            os << "{}\n";
         } else {
-            for (const auto& item : items) {
+            dump(os, items, 0, "");
+        }
+    }
+
+private:
+    // Copy a BVH that lives in someone else's memory into its own storage,
+    // so that it can be changed.
+    void make_owned() {
+        if (nodes.data() != node_storage.data()) {
+            node_storage.assign(nodes.begin(), nodes.end());
+            index_storage.assign(indices.begin(), indices.end());
+            nodes = node_storage;
+            indices = index_storage;
+        }
+    }
+
+    // Copy the subtree under node_storage[from], which has been copied to
+    // out[to], in the same depth-first order as build, leaving out the
+    // nodes that are no longer reachable.
+    void relayout(uint32_t from, uint32_t to, std::vector<BVHNode>& out, std::vector<float>& out_costs) const {
+        const BVHNode& node = node_storage[from];
+        if (node.is_leaf()) {
+            return;
+        }
+        const uint32_t children = out.size();
+        out[to].offset = children;
+        for (uint32_t i = 0; i < 2; i++) {
+            out.push_back(node_storage[node.offset + i]);
+            out_costs.push_back(built_costs[node.offset + i]);
+        }
+        relayout(node.offset, children, out, out_costs);
+        relayout(node.offset + 1, children + 1, out, out_costs);
+    }
+
+    // Bitmask of the lanes that hit the node's bounds before their closest
+    // hit so far.
+    template <size_t N>
+    static uint32_t intersect_lanes(const BVHNode& node, const Rays<N>& rays, const Hits<N>& hits) {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < N; i++) {
+            const float t1x = (node.min[0] - rays.ox[i]) * rays.idx[i];
+            const float t2x = (node.max[0] - rays.ox[i]) * rays.idx[i];
+            const float t1y = (node.min[1] - rays.oy[i]) * rays.idy[i];
+            const float t2y = (node.max[1] - rays.oy[i]) * rays.idy[i];
+            const float t1z = (node.min[2] - rays.oz[i]) * rays.idz[i];
+            const float t2z = (node.max[2] - rays.oz[i]) * rays.idz[i];
+            const float enter = std::max(std::max(std::min(t1x, t2x), std::min(t1y, t2y)), std::min(t1z, t2z));
+            const float exit = std::min(std::min(std::max(t1x, t2x), std::max(t1y, t2y)), std::max(t1z, t2z));
+            mask |= uint32_t(exit >= enter && exit >= 0 && enter <= hits.distance[i]) << i;
+        }
+        return mask;
+    }
+
+    void dump(std::ostream& os, const std::vector<T>& items, uint32_t index, std::string indent) const {
+        const BVHNode& node = nodes[index];
+        os << indent << "{ " << node.count << " items, axis=" << node.axis << ", bounds=" << node.get_bounds() << "\n";
+        std::string indent2 = indent + "  ";
+        if (node.is_leaf()) {
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                const auto& item = items[indices[i]];
                 os << indent2 << item.id << ": " << item.get_center() << "\n";
             }
+        } else {
+            os << indent2 << "2 subvolumes:\n";
+            dump(os, items, node.offset, indent2);
+            dump(os, items, node.offset + 1, indent2);
         }
         os << indent << "}\n";
     }
-
-    friend std::ostream& operator<<(std::ostream& os, const BVH& bvh) {
-        bvh.dump(os << "BVH ", "");
-        return os;
-    }
 };
-
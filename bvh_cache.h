@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <unistd.h>
+
+#include "bvh.h"
+#include "mapped_file.h"
+#include "random.h"
+
+// BVH cache file: this header, then node_count BVHNodes and index_count
+// uint32_t item indices, in native byte order. The BVH is used straight
+// from a memory mapping.
+struct BVHCacheHeader {
+    static constexpr char MAGIC[4] = { 'R', 'T', 'B', 'V' };
+    // Bump when the builder changes, so that old caches are rebuilt.
+    static constexpr uint32_t VERSION = 2;
+
+    char magic[4];
+    uint32_t version;
+    // Hash of everything the builder reads, see bvh_input_hash.
+    uint64_t hash;
+    uint32_t node_count;
+    uint32_t index_count;
+};
+static_assert(sizeof(BVHCacheHeader) == 24);
+static_assert(sizeof(BVHCacheHeader) % alignof(BVHNode) == 0);
+
+// The BVH only depends on the bounds and centers of the items, which ones
+// are tested on their own, the leaf block size the SAH prices leaves by
+// (which follows -march for scene objects) and the split method, so a hash
+// of those identifies it.
+inline uint64_t bvh_input_hash(const std::vector<AABB>& bounds, const std::vector<Point3>& centers,
+                               const std::vector<uint8_t>& singles, uint32_t leaf_block, BVHSplit split) {
+    uint64_t h = splitmix64(BVHCacheHeader::VERSION ^ (uint64_t(split) << 32) ^ (uint64_t(bounds.size()) << 40));
+    h = splitmix64(h ^ leaf_block);
+    auto add = [&](const Vec3& v) {
+        uint32_t bits[3];
+        memcpy(&bits[0], &v.x, 4);
+        memcpy(&bits[1], &v.y, 4);
+        memcpy(&bits[2], &v.z, 4);
+        h = splitmix64(h ^ ((uint64_t(bits[0]) << 32) | bits[1]));
+        h = splitmix64(h ^ bits[2]);
+    };
+    for (size_t i = 0; i < bounds.size(); i++) {
+        add(bounds[i].get_min());
+        add(bounds[i].get_max());
+        add(centers[i]);
+    }
+    for (size_t i = 0; i < singles.size(); i += 8) {
+        uint64_t bits = 0;
+        for (size_t j = i; j < singles.size() && j < i + 8; j++) {
+            bits = bits << 8 | singles[j];
+        }
+        h = splitmix64(h ^ bits);
+    }
+    return h;
+}
+
+// Map the cached BVH at path if it was built from the same input, leaving
+// it in bvh and its mapping in file.
+template <typename T>
+bool load_bvh_cache(const char* path, uint64_t hash, size_t item_count, BVH<T>& bvh, MappedFile& file) {
+    if (access(path, F_OK) != 0) {
+        return false;
+    }
+    MappedFile mapped(path);
+    BVHCacheHeader header;
+    if (!mapped.valid() || mapped.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, mapped.data(), sizeof(header));
+    const size_t expected = sizeof(header) + size_t(header.node_count) * sizeof(BVHNode)
+        + size_t(header.index_count) * sizeof(uint32_t);
+    if (memcmp(header.magic, BVHCacheHeader::MAGIC, 4) != 0 || header.version != BVHCacheHeader::VERSION
+        || header.hash != hash || header.index_count != item_count || mapped.size() != expected) {
+        return false;
+    }
+    const auto* nodes = reinterpret_cast<const BVHNode*>(mapped.data() + sizeof(header));
+    const auto* indices = reinterpret_cast<const uint32_t*>(nodes + header.node_count);
+    BVH<T> cached({ nodes, header.node_count }, { indices, header.index_count });
+    if (!cached.validate(item_count)) {
+        fprintf(stderr, "%s: invalid BVH, rebuilding\n", path);
+        return false;
+    }
+    bvh = std::move(cached);
+    file = std::move(mapped);
+    return true;
+}
+
+// Write to a temporary file and rename it into place, so that other
+// processes never map a half-written cache.
+template <typename T>
+bool save_bvh_cache(const char* path, uint64_t hash, const BVH<T>& bvh) {
+    BVHCacheHeader header;
+    memcpy(header.magic, BVHCacheHeader::MAGIC, 4);
+    header.version = BVHCacheHeader::VERSION;
+    header.hash = hash;
+    header.node_count = bvh.get_nodes().size();
+    header.index_count = bvh.get_indices().size();
+    const std::string temp = std::string(path) + "." + std::to_string(getpid());
+    {
+        std::ofstream os(temp, std::ios::binary);
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        os.write(reinterpret_cast<const char*>(bvh.get_nodes().data()), header.node_count * sizeof(BVHNode));
+        os.write(reinterpret_cast<const char*>(bvh.get_indices().data()), header.index_count * sizeof(uint32_t));
+        if (!os) {
+            perror(temp.c_str());
+            unlink(temp.c_str());
+            return false;
+        }
+    }
+    if (rename(temp.c_str(), path) != 0) {
+        perror(path);
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Build a BVH over items, or use the one cached at cache_path if the items'
+// geometry hasn't changed since it was saved. A rebuilt BVH is saved for the
+// next run. Returns true if the cache was used. A null cache_path just
+// builds.
+template <typename T>
+bool build_bvh_cached(const std::vector<T>& items, BVHSplit split, const char* cache_path,
+                      BVH<T>& bvh, MappedFile& file) {
+    if (!cache_path) {
+        bvh = BVH<T>(items, split);
+        file = MappedFile();
+        return false;
+    }
+    const auto bounds = BVH<T>::item_bounds(items);
+    const auto centers = BVH<T>::item_centers(items);
+    const auto singles = BVH<T>::item_singles(items);
+    const uint64_t hash = bvh_input_hash(bounds, centers, singles, leaf_block<T>::value, split);
+    if (load_bvh_cache(cache_path, hash, items.size(), bvh, file)) {
+        return true;
+    }
+    bvh = BVH<T>(bounds, centers, split, singles);
+    file = MappedFile();
+    save_bvh_cache(cache_path, hash, bvh);
+    return false;
+}
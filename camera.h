@@ -9,11 +9,23 @@ struct CameraOrientation {
     Vec3 up;
 };
 
+// What a Camera is made from, independent of the image size.
+struct CameraParams {
+    CameraOrientation orientation;
+    float vfov;
+    float aperture;
+    float focus_distance;
+};
+
 struct Camera {
     Vec3 origin;
     Vec3 horizontal;
     Vec3 vertical;
     Vec3 corner;
+    // Unit vectors along the image axes, and the radius of the lens, for
+    // depth of field.
+    Vec3 u, v;
+    float lens_radius = 0;
 
     Camera() = default;
 
@@ -22,7 +34,8 @@ struct Camera {
         horizontal(viewport.x, 0, 0),
         vertical(0, viewport.y, 0),
         corner(origin - horizontal * 0.5f - vertical * 0.5f -
-               Vec3(0, 0, focal_length))
+               Vec3(0, 0, focal_length)),
+        u(1, 0, 0), v(0, 1, 0)
     {}
 
     Camera(CameraOrientation orient, float vfov, float aspect_ratio, float aperture, float focal_length)
@@ -33,17 +46,30 @@ struct Camera {
         auto viewport_width = aspect_ratio * viewport_height;
 
         auto w = (orient.lookfrom - orient.lookat).norm();
-        auto u = cross(orient.up, w).norm();
-        auto v = cross(w, u);
+        u = cross(orient.up, w).norm();
+        v = cross(w, u);
 
+        // The image plane is at the focus distance, so that's what is sharp.
         origin = orient.lookfrom;
-        horizontal = viewport_width * u;
-        vertical = viewport_height * v;
-        corner = origin - horizontal * 0.5f - vertical * 0.5f - w;
+        horizontal = focal_length * viewport_width * u;
+        vertical = focal_length * viewport_height * v;
+        corner = origin - horizontal * 0.5f - vertical * 0.5f - focal_length * w;
+        lens_radius = aperture / 2;
     }
 
-    Ray shoot_ray(float u, float v) const {
+    Camera(const CameraParams& params, float aspect_ratio):
+        Camera(params.orientation, params.vfov, aspect_ratio, params.aperture, params.focus_distance)
+    {}
+
+    // Ray through (s, t) on the image, starting from the point on the lens
+    // given by two uniform numbers in [0, 1).
+    Ray shoot_ray(float s, float t, float lens_u = 0, float lens_v = 0) const {
         const Vec3 color{ 1, 1, 1 };
-        return Ray(origin, corner + u * horizontal + v * vertical - origin, color);
+        const float r = lens_radius * std::sqrt(lens_u);
+        const float c = std::cos(float(2 * M_PI) * lens_v);
+        const float sin = std::sqrt(std::max(0.0f, 1 - c * c));
+        const Vec3 offset = r * c * u + r * (lens_v < 0.5f ? sin : -sin) * v;
+        const Vec3 from = origin + offset;
+        return Ray(from, corner + s * horizontal + t * vertical - from, color);
     }
 };
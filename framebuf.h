@@ -4,6 +4,7 @@
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <vector>
 
 #include <cmath>
 
@@ -20,6 +21,16 @@ struct RGB24 {
     {}
     RGB24(uint8_t r, uint8_t g, uint8_t b): r(r), g(g), b(b) {}
 };
+// Linear RGB as floats, for HDR images. Packed, so that a row is
+// 3 * width floats.
+struct RGBF32 {
+    float r, g, b;
+
+    RGBF32() = default;
+    RGBF32(const Vector3 &v): r(v.x), g(v.y), b(v.z) {}
+    RGBF32(float r, float g, float b): r(r), g(g), b(b) {}
+};
+static_assert(sizeof(RGBF32) == 3 * sizeof(float));
 struct GREY8 {
     uint8_t g;
 };
@@ -32,6 +43,39 @@ struct Z32 {
     operator float() const { return z; }
 };
 
+inline float luminance(const Vector3 &c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// Running sums of the samples taken for one pixel.
+struct Accum {
+    Vector3 sum;
+    // Sum of squared luminance, for estimating the variance.
+    float sum_sq = 0;
+    uint32_t samples = 0;
+
+    void add(const Vector3 &color) {
+        sum += color;
+        const float l = luminance(color);
+        sum_sq += l * l;
+        samples++;
+    }
+
+    Vector3 mean() const {
+        return samples ? sum / samples : Vector3();
+    }
+
+    // Estimated variance of the mean's luminance.
+    float variance_of_mean() const {
+        if (samples < 2) {
+            return INFINITY;
+        }
+        const float mean_lum = luminance(sum) / samples;
+        const float variance = (sum_sq - samples * mean_lum * mean_lum) / (samples - 1);
+        return std::max(variance, 0.0f) / samples;
+    }
+};
+
 template <typename T>
 struct px_traits {
     static constexpr auto PPM_FORMAT = nullptr;
@@ -46,9 +90,9 @@ template <>
 struct px_traits<Z32> {
     static constexpr char PPM_FORMAT[] = "P5";
     static constexpr bool raw_writable = false;
-    static void write_ppm(std::ostream& os, const Z32 &px) {
-        char grey = std::clamp(px.z, 0.0f, 1.0f) * 255;
-        os.write(&grey, 1);
+    using ppm_type = uint8_t;
+    static uint8_t to_ppm(const Z32 &px) {
+        return std::clamp(px.z, 0.0f, 1.0f) * 255;
     }
 };
 
@@ -94,14 +138,16 @@ struct framebuf {
         os << PxTraits::PPM_FORMAT << "\n"
             << width << " " << height << "\n"
             << "255\n";
-        for (int y = 0; y < height; y++) {
-            if constexpr (PxTraits::raw_writable) {
+        if constexpr (PxTraits::raw_writable) {
+            for (int y = 0; y < height; y++) {
                 os.write((char*)line(y), sizeof(Px) * width);
             }
-            else {
-                for (int x = 0; x < width; x++) {
-                    PxTraits::write_ppm(os, at(x, y));
-                }
+        } else {
+            // Convert a line at a time, and write it with one call.
+            std::vector<typename PxTraits::ppm_type> converted(width);
+            for (size_t y = 0; y < height; y++) {
+                std::transform(line(y), line(y) + width, converted.begin(), PxTraits::to_ppm);
+                os.write((char*)converted.data(), sizeof(converted[0]) * width);
             }
         }
     }
@@ -0,0 +1,50 @@
+#include "scene.h"
+
+#include <cstdio>
+#include <string_view>
+
+// Write the generated scene to a scene file, for raytrace --scene.
+int main(int argc, const char* argv[]) {
+    BVHSplit split = BVHSplit::SAH;
+    bool with_bvh = true;
+    const char* output = nullptr;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        if (arg == "--bvh" && i + 1 < argc) {
+            const std::string_view value = argv[++i];
+            if (value == "median") {
+                split = BVHSplit::Median;
+            } else if (value == "sah") {
+                split = BVHSplit::SAH;
+            } else if (value == "none") {
+                with_bvh = false;
+            } else {
+                output = nullptr;
+                break;
+            }
+        } else if (!output && arg[0] != '-') {
+            output = argv[i];
+        } else {
+            output = nullptr;
+            break;
+        }
+    }
+    if (!output) {
+        fprintf(stderr, "Usage: %s [--bvh median|sah|none] OUTPUT.scene\n", argv[0]);
+        return 1;
+    }
+
+    // The aspect ratio isn't saved, the camera is set up again on loading.
+    auto scene = generate_scene(1, 1);
+    if (with_bvh) {
+        scene.Finish(split);
+    }
+    if (!save_scene(output, scene, with_bvh)) {
+        return 1;
+    }
+    printf("%zu objects", scene.objects.size());
+    if (with_bvh) {
+        printf(", %zu BVH nodes", scene.bvh->get_nodes().size());
+    }
+    printf("\n");
+}
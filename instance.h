@@ -0,0 +1,81 @@
+#pragma once
+
+#include <memory>
+
+#include "aabb.h"
+#include "mesh.h"
+#include "ray.h"
+#include "rays.h"
+#include "transform.h"
+
+// A shared mesh placed in the scene with an affine transform. The mesh's own
+// BVH is the bottom level, and the scene's BVH over its objects is the top
+// level, so a model can be used any number of times while its triangles and
+// BVH are stored and built once.
+struct Instance {
+    struct Data {
+        std::shared_ptr<const MeshData> mesh;
+        // World space to the mesh's object space.
+        Transform to_object;
+    };
+    // Kept out of line so that it doesn't make every Shape bigger.
+    std::shared_ptr<const Data> data;
+
+    Instance(std::shared_ptr<const MeshData> mesh, const Transform& to_world):
+        data(std::make_shared<Data>(Data { std::move(mesh), to_world.inverse() })) {}
+
+    // The ray is transformed into object space. Its direction is normalized
+    // there too, so distances are scaled by the length of the transformed
+    // direction on the way in and out.
+    void intersect(const Ray& r, HitRecord& out, int id) const {
+        const Transform& to_object = data->to_object;
+        const Vec3 direction = to_object.vector(r.direction);
+        const float scale = direction.len();
+        const Ray local(to_object.point(r.origin), direction, r.color);
+        HitRecord hit;
+        if (out.is_hit()) {
+            hit.distance = out.distance * scale;
+        }
+        data->mesh->intersect(local, hit, id);
+        if (hit.is_hit() && (!out.is_hit() || hit.distance < out.distance * scale)) {
+            out.distance = hit.distance / scale;
+            out.id = id;
+            out.prim = hit.prim;
+        }
+    }
+
+    template <size_t N>
+    void intersect(const Rays<N>& r, Hits<N>& out, int id) const {
+        intersect_each_lane(*this, r, out, id);
+    }
+
+    bool occluded(const Ray& r, float tmax) const {
+        const Transform& to_object = data->to_object;
+        const Vec3 direction = to_object.vector(r.direction);
+        const Ray local(to_object.point(r.origin), direction, r.color);
+        return data->mesh->occluded(local, tmax * direction.len());
+    }
+
+    void set_normal(HitRecord &out, const Ray &r) const {
+        out.p = r.at(out.distance);
+        out.set_normal(r, data->to_object.transpose_vector(data->mesh->normal(out.prim)).norm());
+    }
+
+    Point3 get_center() const {
+        const AABB bounds = get_bounds();
+        return (bounds.get_min() + bounds.get_max()) * 0.5f;
+    }
+
+    AABB get_bounds() const {
+        const Transform to_world = data->to_object.inverse();
+        const AABB& local = data->mesh->get_bounds();
+        const Point3& lo = local.get_min();
+        const Point3& hi = local.get_max();
+        AABB bounds;
+        for (int corner = 0; corner < 8; corner++) {
+            bounds.merge_point(to_world.point({
+                corner & 1 ? hi.x : lo.x, corner & 2 ? hi.y : lo.y, corner & 4 ? hi.z : lo.z }));
+        }
+        return bounds;
+    }
+};
@@ -1,91 +1,89 @@
 #include "bench.h"
 #include "vec.h"
 #include "sphere.h"
-
-using Random = std::minstd_rand;
+#include "rays.h"
+#include "sphere_kernels.h"
 
 constexpr size_t N = 1048576;
 
-struct Hits {
-    float distance[N];
-    int id[N];
-
-    void reset() {
-        std::fill_n(distance, N, INFINITY);
-        std::fill_n(id, N, -1);
+static void fill(Rays<N>& rays, Random& rng) {
+    for (size_t i = 0; i < N; i++) {
+        const Vec3 o = random_in_unit_sphere(rng);
+        const Vec3 d = random_unit_vector(rng);
+        rays.set(i, o, d);
     }
-};
-
-struct Rays {
-    float ox[N];
-    float oy[N];
-    float oz[N];
+}
 
-    float dx[N];
-    float dy[N];
-    float dz[N];
+// Spheres in SoA form, spread around the origin.
+struct SphereTile {
+    std::vector<float> cx, cy, cz, r;
+    std::vector<int> id;
 
-    Vec3 origin(int i) const {
-        return { ox[i], oy[i], oz[i] };
-    }
-    Vec3 direction(int i) const {
-        return { dx[i], dy[i], dz[i] };
+    SphereTile(size_t count, Random& rng) {
+        for (size_t i = 0; i < count; i++) {
+            const Vec3 c = 8 * random_in_unit_sphere(rng);
+            cx.push_back(c.x);
+            cy.push_back(c.y);
+            cz.push_back(c.z);
+            r.push_back(0.5f + rng.uniform());
+            id.push_back(i);
+        }
     }
 
-    void fill(Random& rng) {
-        for (size_t i = 0; i < N; i++) {
-            Vec3 o = random_in_unit_sphere(rng);
-            Vec3 d = random_unit_vector(rng);
-            ox[i] = o.x;
-            oy[i] = o.y;
-            oz[i] = o.z;
-            dx[i] = d.x;
-            dy[i] = d.y;
-            dz[i] = d.z;
-        }
+    SphereArrays arrays() const {
+        return { cx.data(), cy.data(), cz.data(), r.data(), id.data(), id.size() };
     }
 };
 
-static inline float fast_sqrt(float x)
-{
-    return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(x)));
-}
-
-void intersect(const Sphere &s, Hits& out, const Rays &r, int id) {
+// Rays whose hit differs from the one in expected. FMA rounds the
+// discriminant differently, and for grazing rays its square root magnifies
+// that to about sqrt(FLT_EPSILON) of the distance, so distances are
+// compared with a tolerance.
+static size_t mismatches(const Hits<N>& hits, const Hits<N>& expected) {
+    size_t count = 0;
     for (size_t i = 0; i < N; i++) {
-        const Vec3 oc = r.origin(i) - s.center;
-        auto half_b = dot(oc, r.direction(i));
-        auto c = oc.sqlen() - s.radius * s.radius;
-//        if (half_b * half_b < c) {
-//            continue;
-//        }
-
-        auto discriminant = half_b * half_b - c;
-        auto distance = -half_b - fast_sqrt(discriminant);
-        auto mask = -(distance >= 0 && distance < out.distance[i]);
-        out.id[i] = (id & mask) | (out.id[i] & ~mask);
-        out.distance[i] = std::min(distance, out.distance[i]);
+        const float tolerance = 1e-3f * std::max(1.0f, std::abs(expected.distance[i]));
+        if (hits.id[i] != expected.id[i]
+            || (hits.id[i] >= 0 && std::abs(hits.distance[i] - expected.distance[i]) > tolerance)) {
+            count++;
+        }
     }
+    return count;
 }
 
 int main() {
-    int i = 42;
-    static Hits hits;
-    static Rays rays;
-    const Sphere sphere{ { -4, 1, 0 }, 1.0f };
+    static Hits<N> hits;
+    // The first kernel's hits, which the others are checked against.
+    static Hits<N> expected;
+    static Rays<N> rays;
     Random rng;
-    rays.fill(rng);
-    const double nano_t = bench([&]() {
-        hits.reset();
-        intersect(sphere, hits, rays, i++);
-    });
-    double t = nano_t * 1e-9;
-    printf("%fs for %zu rays => %f rays/s\n", t, N, N / t);
-    size_t nhits = 0;
-    for (size_t i = 0; i < N; i++) {
-        if (hits.id[i] >= 0) {
-            nhits++;
+    fill(rays, rng);
+    printf("Dispatched kernel: %s\n", sphere_kernel.name);
+    for (size_t count : { 1, 16 }) {
+        const SphereTile tile(count, rng);
+        bool first = true;
+        for (const auto& kernel : supported_sphere_kernels()) {
+            const double nano_t = bench([&]() {
+                hits.reset();
+                kernel.kernel(ray_arrays(rays, hits), tile.arrays());
+            });
+            double t = nano_t * 1e-9;
+            size_t nhits = 0;
+            for (size_t i = 0; i < N; i++) {
+                if (hits.id[i] >= 0) {
+                    nhits++;
+                }
+            }
+            if (first) {
+                expected = hits;
+                first = false;
+            }
+            printf("%-8s %2zu spheres: %fs for %zu rays => %f rays/s, %zu / %zu hits", kernel.name, count, t,
+                   N, N / t, nhits, N);
+            if (const size_t wrong = mismatches(hits, expected)) {
+                printf(" (MISMATCH in %zu rays)", wrong);
+            }
+            printf("\n");
         }
     }
-    printf("%zu / %zu hits\n", nhits, N);
 }
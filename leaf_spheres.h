@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <variant>
+#include <vector>
+
+#include "base.h"
+#include "sphere.h"
+#include "sphere_kernels.h"
+#include "wide_bvh.h"
+
+// The spheres of a BVH's leaves in structure-of-arrays form, in the order
+// of the BVH's item indices, so that a leaf's spheres are next to each
+// other and are tested in blocks of W with SIMD: a whole leaf at once with
+// AVX2, since leaves have at most 8 items.
+//
+// Items that aren't spheres are left to the caller, see is_other.
+template <int W = BVH_WIDTH>
+class LeafSpheres {
+    using Simd = SimdFloat<W>;
+
+    std::vector<float> cx, cy, cz, r;
+    std::vector<int> id;
+    // Bit j is set if the item at k + j isn't a sphere, for j < W.
+    std::vector<uint32_t> other_bits;
+    bool any_others = false;
+
+public:
+    // The ray broadcast to all lanes, once per traversal.
+    struct SimdRay {
+        typename Simd::type ox, oy, oz, dx, dy, dz;
+
+        explicit SimdRay(const Ray& ray):
+            ox(Simd::set1(ray.origin.x)), oy(Simd::set1(ray.origin.y)), oz(Simd::set1(ray.origin.z)),
+            dx(Simd::set1(ray.direction.x)), dy(Simd::set1(ray.direction.y)), dz(Simd::set1(ray.direction.z))
+        {}
+    };
+
+    LeafSpheres() {}
+
+    // items[indices[k]] is the item at k, with its shape variant in
+    // .shape and its id in .id.
+    template <typename Items>
+    LeafSpheres(ArrayRef<uint32_t> indices, const Items& items) {
+        // Padded so that a block can be loaded from any item.
+        const size_t size = indices.size() + W;
+        for (auto* v : { &cx, &cy, &cz, &r }) {
+            v->resize(size, 0);
+        }
+        id.resize(size, -1);
+        other_bits.resize(size, 0);
+        for (size_t k = 0; k < indices.size(); k++) {
+            const auto& item = items[indices[k]];
+            id[k] = item.id;
+            if (const auto* sphere = std::get_if<Sphere>(&item.shape)) {
+                cx[k] = sphere->center.x;
+                cy[k] = sphere->center.y;
+                cz[k] = sphere->center.z;
+                r[k] = sphere->radius;
+                continue;
+            }
+            any_others = true;
+            for (size_t j = 0; j < W && j <= k; j++) {
+                other_bits[k - j] |= 1u << j;
+            }
+        }
+    }
+
+    // Whether any of the items in [first, first + count) isn't a sphere.
+    bool has_others(uint32_t first, uint32_t count) const {
+        if (!any_others) {
+            return false;
+        }
+        for (uint32_t block = first; block < first + count; block += W) {
+            if (other_bits[block] & block_lanes(block, first + count)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Whether the item at k isn't a sphere.
+    bool is_other(uint32_t k) const {
+        return other_bits[k] & 1;
+    }
+
+    // Bitmask of the lanes of the block at first that the ray hits closer
+    // than tmax, with their distances.
+    ALWAYS_INLINE int hit_lanes(const SimdRay& ray, uint32_t first, float tmax, float* distances) const {
+        const auto zero = Simd::set1(0);
+        const auto ocx = ray.ox - Simd::loadu(&cx[first]);
+        const auto ocy = ray.oy - Simd::loadu(&cy[first]);
+        const auto ocz = ray.oz - Simd::loadu(&cz[first]);
+        const auto radius = Simd::loadu(&r[first]);
+        const auto half_b = ocx * ray.dx + ocy * ray.dy + ocz * ray.dz;
+        const auto c = ocx * ocx + ocy * ocy + ocz * ocz - radius * radius;
+        const auto discriminant = half_b * half_b - c;
+        const auto distance = zero - half_b - Simd::sqrt(Simd::max(discriminant, zero));
+        Simd::store(distances, distance);
+        return Simd::less_equal(zero, discriminant) & Simd::less_equal(zero, distance)
+            & Simd::less(distance, Simd::set1(tmax)) & ~int(other_bits[first]);
+    }
+
+    // Lanes of the block at first that are in a leaf ending at end.
+    static int block_lanes(uint32_t first, uint32_t end) {
+        return end - first >= W ? (1 << W) - 1 : (1 << (end - first)) - 1;
+    }
+
+    // Intersect the ray with the spheres in [first, first + count),
+    // updating out with the closest hit.
+    ALWAYS_INLINE void intersect(const SimdRay& ray, uint32_t first, uint32_t count, HitRecord& out) const {
+        alignas(W * sizeof(float)) float distances[W];
+        for (uint32_t block = first; block < first + count; block += W) {
+            const float tmax = out.is_hit() ? out.distance : INFINITY;
+            int mask = hit_lanes(ray, block, tmax, distances) & block_lanes(block, first + count);
+            while (mask) {
+                const int i = __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (distances[i] < out.distance || !out.is_hit()) {
+                    out.distance = distances[i];
+                    out.id = id[block + i];
+                }
+            }
+        }
+    }
+
+    ALWAYS_INLINE bool occluded(const SimdRay& ray, uint32_t first, uint32_t count, float tmax) const {
+        alignas(W * sizeof(float)) float distances[W];
+        for (uint32_t block = first; block < first + count; block += W) {
+            if (hit_lanes(ray, block, tmax, distances) & block_lanes(block, first + count)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Intersect a packet of rays with the spheres in [first, first + count)
+    // as a rays x spheres tile. The range must not have other items.
+    template <size_t N>
+    void intersect(const Rays<N>& rays, Hits<N>& hits, uint32_t first, uint32_t count) const {
+        intersect_spheres(ray_arrays(rays, hits), { &cx[first], &cy[first], &cz[first], &r[first], &id[first], count });
+    }
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file. Check valid() after
+// construction; errors are reported with perror.
+class MappedFile {
+    void* data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    MappedFile() = default;
+
+    explicit MappedFile(const char* path) {
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            perror(path);
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            perror(path);
+            ::close(fd);
+            return;
+        }
+        if (st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                perror(path);
+            } else {
+                data_ = p;
+                size_ = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+
+    MappedFile(MappedFile&& other):
+        data_(std::exchange(other.data_, nullptr)),
+        size_(std::exchange(other.size_, 0))
+    {}
+
+    MappedFile& operator=(MappedFile&& other) {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(data_, size_);
+        }
+    }
+
+    bool valid() const {
+        return data_ != nullptr;
+    }
+
+    const char* data() const {
+        return static_cast<const char*>(data_);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+};
@@ -1,13 +1,101 @@
 #pragma once
 
-using Random = std::minstd_rand;
+#include <vector>
 
 struct ScatterResult {
     Vec3 direction;
     Vec3 color;
 };
 
-inline double pow5(const double x)
+// Structure-of-arrays data for many hits on the same type of material, so
+// that each material can scatter a whole batch in one vectorizable loop.
+struct ShadeBatch {
+    size_t size = 0;
+    // Index of the path each hit belongs to.
+    std::vector<uint32_t> path;
+    // Hit point.
+    std::vector<float> px, py, pz;
+    // Surface normal, facing against the incoming ray.
+    std::vector<float> nx, ny, nz;
+    // Incoming direction, replaced by the scattered direction.
+    std::vector<float> dx, dy, dz;
+    // Path throughput, scaled by the material's attenuation.
+    std::vector<float> r, g, b;
+    // 1 if the ray hit the outside of the surface, otherwise 0.
+    std::vector<float> front_face;
+    // Material parameters, meaning depends on the material.
+    std::vector<float> ar, ag, ab, param;
+    // Uniform random numbers in [0, 1). u3 is for the integrator's Russian
+    // roulette, u4 and u5 for its light samples.
+    std::vector<float> u0, u1, u2, u3, u4, u5;
+
+    // Unaliased pointers to the arrays, passed by value to the kernels.
+    // Indexing the vectors directly (or using a local Arrays) makes GCC give
+    // up on vectorizing, because it needs too many runtime alias checks.
+    struct Arrays {
+        const float* __restrict px, * __restrict py, * __restrict pz;
+        const float* __restrict nx, * __restrict ny, * __restrict nz;
+        float* __restrict dx, * __restrict dy, * __restrict dz;
+        float* __restrict r, * __restrict g, * __restrict b;
+        const float* __restrict front_face;
+        const float* __restrict ar, * __restrict ag, * __restrict ab, * __restrict param;
+        const float* __restrict u0, * __restrict u1, * __restrict u2;
+
+        Arrays(ShadeBatch& batch):
+            px(batch.px.data()), py(batch.py.data()), pz(batch.pz.data()),
+            nx(batch.nx.data()), ny(batch.ny.data()), nz(batch.nz.data()),
+            dx(batch.dx.data()), dy(batch.dy.data()), dz(batch.dz.data()),
+            r(batch.r.data()), g(batch.g.data()), b(batch.b.data()),
+            front_face(batch.front_face.data()),
+            ar(batch.ar.data()), ag(batch.ag.data()), ab(batch.ab.data()), param(batch.param.data()),
+            u0(batch.u0.data()), u1(batch.u1.data()), u2(batch.u2.data())
+        {}
+    };
+
+    void clear() {
+        size = 0;
+    }
+
+    size_t add(uint32_t path_index, const HitRecord& hit, const Ray& ray) {
+        const size_t i = size++;
+        if (path.size() < size) {
+            for (auto* v : { &px, &py, &pz, &nx, &ny, &nz, &dx, &dy, &dz,
+                             &r, &g, &b, &front_face, &ar, &ag, &ab, &param,
+                             &u0, &u1, &u2, &u3, &u4, &u5 }) {
+                v->resize(size);
+            }
+            path.resize(size);
+        }
+        path[i] = path_index;
+        px[i] = hit.p.x;
+        py[i] = hit.p.y;
+        pz[i] = hit.p.z;
+        nx[i] = hit.normal.x;
+        ny[i] = hit.normal.y;
+        nz[i] = hit.normal.z;
+        dx[i] = ray.direction.x;
+        dy[i] = ray.direction.y;
+        dz[i] = ray.direction.z;
+        r[i] = ray.color.x;
+        g[i] = ray.color.y;
+        b[i] = ray.color.z;
+        front_face[i] = hit.front_face;
+        return i;
+    }
+
+    void fill_random(Random& rng, bool light_samples) {
+        rng.fill(u0.data(), size);
+        rng.fill(u1.data(), size);
+        rng.fill(u2.data(), size);
+        rng.fill(u3.data(), size);
+        if (light_samples) {
+            rng.fill(u4.data(), size);
+            rng.fill(u5.data(), size);
+        }
+    }
+};
+
+inline float pow5(const float x)
 {
     const auto x2 = x * x;
     const auto x4 = x2 * x2;
@@ -15,6 +103,8 @@ inline double pow5(const double x)
 }
 
 struct Metal {
+    static constexpr const char* NAME = "metal";
+
     Vec3 albedo;
     float fuzziness = 1.0f;
 
@@ -24,8 +114,34 @@ struct Metal {
         return { reflected + fuzziness * random_in_unit_sphere(rng),
             albedo * ray.color };
     }
+
+    void gather(ShadeBatch& batch, size_t i) const
+    {
+        batch.ar[i] = albedo.x;
+        batch.ag[i] = albedo.y;
+        batch.ab[i] = albedo.z;
+        batch.param[i] = fuzziness;
+    }
+
+    static void scatter(ShadeBatch::Arrays a, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            const float dn = a.dx[i] * a.nx[i] + a.dy[i] * a.ny[i] + a.dz[i] * a.nz[i];
+            float x, y, z;
+            uniform_in_unit_sphere(a.u0[i], a.u1[i], a.u2[i], x, y, z);
+            const float fuzz = a.param[i];
+            a.dx[i] = a.dx[i] - 2 * dn * a.nx[i] + fuzz * x;
+            a.dy[i] = a.dy[i] - 2 * dn * a.ny[i] + fuzz * y;
+            a.dz[i] = a.dz[i] - 2 * dn * a.nz[i] + fuzz * z;
+            a.r[i] *= a.ar[i];
+            a.g[i] *= a.ag[i];
+            a.b[i] *= a.ab[i];
+        }
+    }
 };
 struct Dielectric {
+    static constexpr const char* NAME = "dielectric";
+
     float refraction;
 
     ScatterResult scatter(const HitRecord& hit, const Ray& ray, Random& rng) const
@@ -38,7 +154,7 @@ struct Dielectric {
         const auto cos_theta = std::min(dot(-v, n), 1.0f);
         const auto sin_theta = std::sqrt(1 - cos_theta * cos_theta);
 
-        const auto thresh = std::uniform_real_distribution<float>(0, 1)(rng);
+        const auto thresh = random_float(rng);
 
         if (reflectance(cos_theta, ratio) > thresh || ratio * sin_theta > 1)
             return { reflect(v, n), ray.color };
@@ -50,8 +166,34 @@ struct Dielectric {
         return { refracted, ray.color };
     }
 
+    void gather(ShadeBatch& batch, size_t i) const
+    {
+        batch.param[i] = refraction;
+    }
+
+    static void scatter(ShadeBatch::Arrays a, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            const float refraction = a.param[i];
+            const float ratio = a.front_face[i] != 0 ? 1 / refraction : refraction;
+            const float dn = a.dx[i] * a.nx[i] + a.dy[i] * a.ny[i] + a.dz[i] * a.nz[i];
+            const float cos_theta = std::min(-dn, 1.0f);
+            const float sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+
+            const float perp_x = ratio * (a.dx[i] + cos_theta * a.nx[i]);
+            const float perp_y = ratio * (a.dy[i] + cos_theta * a.ny[i]);
+            const float perp_z = ratio * (a.dz[i] + cos_theta * a.nz[i]);
+            const float para = -std::sqrt(std::abs(1.0f - (perp_x * perp_x + perp_y * perp_y + perp_z * perp_z)));
+
+            const bool reflects = reflectance(cos_theta, ratio) > a.u0[i] || ratio * sin_theta > 1;
+            a.dx[i] = reflects ? a.dx[i] - 2 * dn * a.nx[i] : perp_x + para * a.nx[i];
+            a.dy[i] = reflects ? a.dy[i] - 2 * dn * a.ny[i] : perp_y + para * a.ny[i];
+            a.dz[i] = reflects ? a.dz[i] - 2 * dn * a.nz[i] : perp_z + para * a.nz[i];
+        }
+    }
+
     // Schlick's approximation
-    static float reflectance(double cos, double ratio)
+    static float reflectance(float cos, float ratio)
     {
         auto r0 = (1 - ratio) / (1 + ratio);
         r0 *= r0;
@@ -59,16 +201,62 @@ struct Dielectric {
     }
 };
 struct Lambertian {
+    static constexpr const char* NAME = "lambertian";
+
     Vec3 albedo;
 
     ScatterResult scatter(const HitRecord& hit, const Ray& ray, Random& rng) const
     {
         auto direction = hit.normal + random_unit_vector(rng);
         if (direction.near_zero()) {
-            printf("Very unlucky - random vector antiparallel to normal\n");
+            // Random vector antiparallel to the normal
             direction = hit.normal;
         }
         return { direction, albedo * ray.color };
     }
+
+    void gather(ShadeBatch& batch, size_t i) const
+    {
+        batch.ar[i] = albedo.x;
+        batch.ag[i] = albedo.y;
+        batch.ab[i] = albedo.z;
+    }
+
+    static void scatter(ShadeBatch::Arrays a, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            float ux, uy, uz;
+            uniform_unit_vector(a.u0[i], a.u1[i], ux, uy, uz);
+            const float x = a.nx[i] + ux;
+            const float y = a.ny[i] + uy;
+            const float w = a.nz[i] + uz;
+            const bool near_zero = std::abs(x) < 1e-8f && std::abs(y) < 1e-8f && std::abs(w) < 1e-8f;
+            a.dx[i] = near_zero ? a.nx[i] : x;
+            a.dy[i] = near_zero ? a.ny[i] : y;
+            a.dz[i] = near_zero ? a.nz[i] : w;
+            a.r[i] *= a.ar[i];
+            a.g[i] *= a.ag[i];
+            a.b[i] *= a.ab[i];
+        }
+    }
 };
+// Light source. It doesn't scatter: paths end where they hit it, and the
+// integrator adds its emission.
+struct Emissive {
+    static constexpr const char* NAME = "emissive";
+
+    Vec3 emission;
+
+    ScatterResult scatter(const HitRecord& hit, const Ray&, Random&) const
+    {
+        return { hit.normal, Vec3() };
+    }
 
+    void gather(ShadeBatch&, size_t) const
+    {
+    }
+
+    static void scatter(ShadeBatch::Arrays, size_t)
+    {
+    }
+};
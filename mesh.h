@@ -0,0 +1,321 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "mapped_file.h"
+#include "ray.h"
+#include "rays.h"
+#include "vec.h"
+
+// Binary mesh file: this header, then vertex_count float[3] positions, then
+// triangle_count uint32_t[3] vertex indices, all in native byte order. The
+// arrays can be used straight from a memory mapping.
+struct MeshFileHeader {
+    static constexpr char MAGIC[4] = { 'R', 'T', 'M', 'S' };
+    static constexpr uint32_t VERSION = 1;
+
+    char magic[4];
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+};
+static_assert(sizeof(MeshFileHeader) == 16);
+
+inline bool save_mesh(const char* path, const float* vertices, uint32_t vertex_count,
+                      const uint32_t* triangles, uint32_t triangle_count) {
+    MeshFileHeader header;
+    memcpy(header.magic, MeshFileHeader::MAGIC, 4);
+    header.version = MeshFileHeader::VERSION;
+    header.vertex_count = vertex_count;
+    header.triangle_count = triangle_count;
+    std::ofstream os(path, std::ios::binary);
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    os.write(reinterpret_cast<const char*>(vertices), size_t(vertex_count) * 3 * sizeof(float));
+    os.write(reinterpret_cast<const char*>(triangles), size_t(triangle_count) * 3 * sizeof(uint32_t));
+    return bool(os);
+}
+
+// Ray set up for the watertight ray/triangle test of Woop, Benthin and
+// Wald, "Watertight Ray/Triangle Intersection" (JCGT 2013). Triangles are
+// transformed into a space where the ray goes along +z from the origin, so
+// that the edge tests of neighbouring triangles agree exactly.
+struct WatertightRay {
+    Point3 origin;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    explicit WatertightRay(const Ray& ray): origin(ray.origin) {
+        const Vec3 d = ray.direction;
+        const float ad[3] = { std::abs(d.x), std::abs(d.y), std::abs(d.z) };
+        kz = ad[0] > ad[1] ? (ad[0] > ad[2] ? 0 : 2) : (ad[1] > ad[2] ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        const float dir[3] = { d.x, d.y, d.z };
+        // Keep the winding the same.
+        if (dir[kz] < 0) {
+            std::swap(kx, ky);
+        }
+        sx = dir[kx] / dir[kz];
+        sy = dir[ky] / dir[kz];
+        sz = 1 / dir[kz];
+    }
+};
+
+// Triangle mesh geometry: shared, indexed vertex buffers and a BVH over the
+// triangles. The buffers are either owned or point into a memory-mapped
+// mesh file.
+class MeshData {
+    // Only used to build the BVH.
+    struct BuildItem {
+        AABB bounds;
+        Point3 center;
+
+        AABB get_bounds() const { return bounds; }
+        const Point3& get_center() const { return center; }
+    };
+
+    std::vector<float> vertex_storage;
+    std::vector<uint32_t> triangle_storage;
+    MappedFile file;
+
+    const float* vertices = nullptr;
+    const uint32_t* triangles = nullptr;
+    uint32_t vertex_count = 0;
+    uint32_t triangle_count = 0;
+
+    AABB bounds;
+    BVH<BuildItem> bvh;
+    // Holds the BVH when it was mapped from a cache file.
+    MappedFile bvh_file;
+    bool bvh_cached = false;
+
+    // Triangles per vectorized leaf test.
+    static constexpr uint32_t LANES = 8;
+    // Hits closer than this are taken to be the surface the ray starts on.
+    static constexpr float MIN_DISTANCE = 1e-4f;
+
+    void build(BVHSplit split, const char* cache_path = nullptr) {
+        std::vector<BuildItem> items(triangle_count);
+        bounds = AABB();
+        for (uint32_t i = 0; i < vertex_count; i++) {
+            bounds.merge_point(vertex(i));
+        }
+        for (uint32_t t = 0; t < triangle_count; t++) {
+            AABB b;
+            for (int k = 0; k < 3; k++) {
+                b.merge_point(vertex(triangles[3 * t + k]));
+            }
+            items[t] = { b, (b.get_min() + b.get_max()) * 0.5f };
+        }
+        bvh_cached = build_bvh_cached(items, split, cache_path, bvh, bvh_file);
+    }
+
+    // Test the ray against up to LANES triangles at once. The vertices are
+    // gathered into structure-of-arrays form, relative to the ray origin and
+    // with the ray's axes, so that the test itself vectorizes.
+    void intersect_leaf(const WatertightRay& ray, const uint32_t* leaf, uint32_t count,
+                        HitRecord& out, int id) const {
+        for (uint32_t first = 0; first < count; first += LANES) {
+            const uint32_t n = std::min(LANES, count - first);
+            alignas(32) float ax[LANES], ay[LANES], az[LANES];
+            alignas(32) float bx[LANES], by[LANES], bz[LANES];
+            alignas(32) float cx[LANES], cy[LANES], cz[LANES];
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                // Repeat the last triangle to fill the unused lanes.
+                const uint32_t* tri = &triangles[3 * leaf[first + std::min(lane, n - 1)]];
+                const float* a = &vertices[3 * tri[0]];
+                const float* b = &vertices[3 * tri[1]];
+                const float* c = &vertices[3 * tri[2]];
+                const float o[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+                ax[lane] = a[ray.kx] - o[ray.kx];
+                ay[lane] = a[ray.ky] - o[ray.ky];
+                az[lane] = a[ray.kz] - o[ray.kz];
+                bx[lane] = b[ray.kx] - o[ray.kx];
+                by[lane] = b[ray.ky] - o[ray.ky];
+                bz[lane] = b[ray.kz] - o[ray.kz];
+                cx[lane] = c[ray.kx] - o[ray.kx];
+                cy[lane] = c[ray.ky] - o[ray.ky];
+                cz[lane] = c[ray.kz] - o[ray.kz];
+            }
+
+            const float tmax = out.is_hit() ? out.distance : INFINITY;
+            alignas(32) float t[LANES];
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                const float Ax = ax[lane] - ray.sx * az[lane];
+                const float Ay = ay[lane] - ray.sy * az[lane];
+                const float Bx = bx[lane] - ray.sx * bz[lane];
+                const float By = by[lane] - ray.sy * bz[lane];
+                const float Cx = cx[lane] - ray.sx * cz[lane];
+                const float Cy = cy[lane] - ray.sy * cz[lane];
+                const float U = Cx * By - Cy * Bx;
+                const float V = Ax * Cy - Ay * Cx;
+                const float W = Bx * Ay - By * Ax;
+                const bool outside = (U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0);
+                const float det = U + V + W;
+                const float T = ray.sz * (U * az[lane] + V * bz[lane] + W * cz[lane]);
+                const float distance = T / det;
+                const bool hit = !outside && det != 0 && distance > MIN_DISTANCE && distance < tmax;
+                t[lane] = hit ? distance : INFINITY;
+            }
+
+            for (uint32_t lane = 0; lane < n; lane++) {
+                if (t[lane] < (out.is_hit() ? out.distance : INFINITY)) {
+                    out.distance = t[lane];
+                    out.id = id;
+                    out.prim = leaf[first + lane];
+                }
+            }
+        }
+    }
+
+public:
+    MeshData(std::vector<float> vertex_data, std::vector<uint32_t> triangle_data, BVHSplit split = BVHSplit::SAH):
+        vertex_storage(std::move(vertex_data)), triangle_storage(std::move(triangle_data)),
+        vertices(vertex_storage.data()), triangles(triangle_storage.data()),
+        vertex_count(vertex_storage.size() / 3), triangle_count(triangle_storage.size() / 3)
+    {
+        build(split);
+    }
+
+    // Map a binary mesh file. Returns null (after printing why) if the file
+    // can't be read or is not a valid mesh. With use_cache, the BVH is
+    // cached in path.bvh.
+    static std::shared_ptr<const MeshData> load(const char* path, BVHSplit split = BVHSplit::SAH,
+                                                bool use_cache = true) {
+        MappedFile file(path);
+        if (!file.valid()) {
+            return nullptr;
+        }
+        MeshFileHeader header;
+        if (file.size() < sizeof(header)) {
+            fprintf(stderr, "%s: too short for a mesh file\n", path);
+            return nullptr;
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        if (memcmp(header.magic, MeshFileHeader::MAGIC, 4) != 0 || header.version != MeshFileHeader::VERSION) {
+            fprintf(stderr, "%s: not a version %u mesh file\n", path, MeshFileHeader::VERSION);
+            return nullptr;
+        }
+        const size_t expected = sizeof(header) + size_t(header.vertex_count) * 3 * sizeof(float)
+            + size_t(header.triangle_count) * 3 * sizeof(uint32_t);
+        if (file.size() != expected) {
+            fprintf(stderr, "%s: size %zu doesn't match header (%zu)\n", path, file.size(), expected);
+            return nullptr;
+        }
+
+        std::shared_ptr<MeshData> mesh(new MeshData());
+        mesh->vertices = reinterpret_cast<const float*>(file.data() + sizeof(header));
+        mesh->triangles = reinterpret_cast<const uint32_t*>(mesh->vertices + 3 * size_t(header.vertex_count));
+        mesh->vertex_count = header.vertex_count;
+        mesh->triangle_count = header.triangle_count;
+        mesh->file = std::move(file);
+        for (size_t i = 0; i < 3 * size_t(mesh->triangle_count); i++) {
+            if (mesh->triangles[i] >= mesh->vertex_count) {
+                fprintf(stderr, "%s: vertex index %u out of range\n", path, mesh->triangles[i]);
+                return nullptr;
+            }
+        }
+        mesh->build(split, use_cache ? (std::string(path) + ".bvh").c_str() : nullptr);
+        return mesh;
+    }
+
+    bool save(const char* path) const {
+        return save_mesh(path, vertices, vertex_count, triangles, triangle_count);
+    }
+
+    uint32_t get_vertex_count() const { return vertex_count; }
+    uint32_t get_triangle_count() const { return triangle_count; }
+    const AABB& get_bounds() const { return bounds; }
+    const BVH<BuildItem>& get_bvh() const { return bvh; }
+    bool bvh_from_cache() const { return bvh_cached; }
+
+    Point3 vertex(uint32_t i) const {
+        return { vertices[3 * i], vertices[3 * i + 1], vertices[3 * i + 2] };
+    }
+
+    // Geometric normal of a triangle, following its winding.
+    Vec3 normal(uint32_t triangle) const {
+        const uint32_t* tri = &triangles[3 * triangle];
+        const Point3 a = vertex(tri[0]);
+        return cross(vertex(tri[1]) - a, vertex(tri[2]) - a).norm();
+    }
+
+    void intersect(const Ray& ray, HitRecord& out, int id) const {
+        const WatertightRay wray(ray);
+        bvh.traverse(ray, out, [&](const uint32_t* leaf, uint32_t count) {
+            intersect_leaf(wray, leaf, count, out, id);
+        });
+    }
+
+    bool occluded(const Ray& ray, float tmax) const {
+        const WatertightRay wray(ray);
+        HitRecord out;
+        out.distance = tmax;
+        return bvh.traverse(ray, out, [&](const uint32_t* leaf, uint32_t count) {
+            intersect_leaf(wray, leaf, count, out, 0);
+            return out.distance < tmax;
+        });
+    }
+
+private:
+    MeshData() = default;
+};
+
+// Packet intersection for shapes without a packet traversal of their own:
+// each lane is traced on its own.
+template <typename S, size_t N>
+void intersect_each_lane(const S& shape, const Rays<N>& r, Hits<N>& out, int id) {
+    for (size_t i = 0; i < N; i++) {
+        const Ray ray(r.origin(i), r.direction(i), Vec3(1, 1, 1));
+        HitRecord hit;
+        if (out.distance[i] < INFINITY) {
+            hit.distance = out.distance[i];
+        }
+        shape.intersect(ray, hit, id);
+        if (hit.is_hit() && hit.distance < out.distance[i]) {
+            out.distance[i] = hit.distance;
+            out.id[i] = id;
+            out.prim[i] = hit.prim;
+        }
+    }
+}
+
+// Shape for a triangle mesh. The geometry is shared, so copies are cheap.
+struct Mesh {
+    std::shared_ptr<const MeshData> data;
+
+    void intersect(const Ray& r, HitRecord& out, int id) const {
+        data->intersect(r, out, id);
+    }
+
+    template <size_t N>
+    void intersect(const Rays<N>& r, Hits<N>& out, int id) const {
+        intersect_each_lane(*this, r, out, id);
+    }
+
+    bool occluded(const Ray& r, float tmax) const {
+        return data->occluded(r, tmax);
+    }
+
+    void set_normal(HitRecord &out, const Ray &r) const {
+        out.p = r.at(out.distance);
+        out.set_normal(r, data->normal(out.prim));
+    }
+
+    Point3 get_center() const {
+        const AABB& bounds = data->get_bounds();
+        return (bounds.get_min() + bounds.get_max()) * 0.5f;
+    }
+
+    AABB get_bounds() const {
+        return data->get_bounds();
+    }
+};
@@ -0,0 +1,70 @@
+#include "mesh.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Convert the vertices and faces of a Wavefront OBJ file into a binary mesh
+// file. Polygons are split into triangle fans, everything else is ignored.
+int main(int argc, const char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s INPUT.obj OUTPUT.mesh\n", argv[0]);
+        return 1;
+    }
+    std::ifstream is(argv[1]);
+    if (!is) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    std::vector<float> vertices;
+    std::vector<uint32_t> triangles;
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(is, line)) {
+        line_number++;
+        std::istringstream ls(line);
+        std::string type;
+        ls >> type;
+        if (type == "v") {
+            float x, y, z;
+            ls >> x >> y >> z;
+            vertices.insert(vertices.end(), { x, y, z });
+        } else if (type == "f") {
+            std::vector<uint32_t> face;
+            std::string corner;
+            while (ls >> corner) {
+                // v, v/vt, v//vn or v/vt/vn; negative indices count from the
+                // end.
+                char* end;
+                errno = 0;
+                const long index = strtol(corner.c_str(), &end, 10);
+                if (end == corner.c_str() || (*end && *end != '/') || errno == ERANGE) {
+                    fprintf(stderr, "%s:%zu: bad vertex index %s\n", argv[1], line_number, corner.c_str());
+                    return 1;
+                }
+                const long vertex_count = vertices.size() / 3;
+                const long resolved = index < 0 ? vertex_count + index : index - 1;
+                if (resolved < 0 || resolved >= vertex_count) {
+                    fprintf(stderr, "%s:%zu: vertex index %ld out of range\n", argv[1], line_number, index);
+                    return 1;
+                }
+                face.push_back(resolved);
+            }
+            for (size_t i = 2; i < face.size(); i++) {
+                triangles.insert(triangles.end(), { face[0], face[i - 1], face[i] });
+            }
+        }
+    }
+
+    const uint32_t vertex_count = vertices.size() / 3;
+    const uint32_t triangle_count = triangles.size() / 3;
+    if (!save_mesh(argv[2], vertices.data(), vertex_count, triangles.data(), triangle_count)) {
+        perror(argv[2]);
+        return 1;
+    }
+    printf("%u vertices, %u triangles\n", vertex_count, triangle_count);
+}
@@ -0,0 +1,551 @@
+#pragma once
+
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#include <tbb/parallel_for.h>
+#endif
+#include <tbb/task_arena.h>
+
+#include "framebuf.h"
+#include "tiles.h"
+#include "tonemap.h"
+
+// Image file format backend. Gets the rows of an image in order, as linear
+// RGB floats, a band of complete rows at a time.
+class ImageWriter {
+public:
+    // Conversion to 8 bits, for the formats that need it.
+    ToneMapSettings tonemap;
+
+    virtual ~ImageWriter() = default;
+
+    // Returns false after printing why if the file can't be created.
+    virtual bool open(const char* path, int width, int height) = 0;
+    // Rows [y0, y1), packed, width pixels per row.
+    virtual void write_rows(int y0, int y1, const RGBF32* rgb) = 0;
+    virtual bool close() = 0;
+};
+
+// Binary PPM (P6), 8 bits per channel.
+class PPMWriter : public ImageWriter {
+    std::ofstream os;
+    std::string path;
+    int width = 0;
+    std::vector<uint8_t> bytes;
+
+public:
+    bool open(const char* path, int width, int height) override {
+        this->path = path;
+        this->width = width;
+        os.open(path, std::ios::binary);
+        if (!os) {
+            perror(path);
+            return false;
+        }
+        os << "P6\n" << width << " " << height << "\n255\n";
+        return true;
+    }
+
+    void write_rows(int y0, int y1, const RGBF32* rgb) override {
+        const size_t n = size_t(width) * (y1 - y0);
+        bytes.resize(3 * n);
+        tone_map(tonemap, rgb, n, size_t(width) * y0, bytes.data());
+        os.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    }
+
+    bool close() override {
+        os.close();
+        if (!os) {
+            perror(path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// Portable float map: 32-bit float RGB, little endian, for HDR. Stores the
+// linear values as rendered, without tone mapping. Rows are stored bottom
+// to top, so each band is written at its own offset.
+class PFMWriter : public ImageWriter {
+    std::ofstream os;
+    std::string path;
+    int width = 0, height = 0;
+    std::streamoff data_offset = 0;
+
+public:
+    bool open(const char* path, int width, int height) override {
+        static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the scale below says little endian");
+        this->path = path;
+        this->width = width;
+        this->height = height;
+        os.open(path, std::ios::binary);
+        if (!os) {
+            perror(path);
+            return false;
+        }
+        os << "PF\n" << width << " " << height << "\n-1.0\n";
+        data_offset = os.tellp();
+        return true;
+    }
+
+    void write_rows(int y0, int y1, const RGBF32* rgb) override {
+        const size_t row_bytes = sizeof(RGBF32) * width;
+        for (int y = y0; y < y1; y++) {
+            os.seekp(data_offset + std::streamoff(height - 1 - y) * row_bytes);
+            os.write(reinterpret_cast<const char*>(rgb + size_t(width) * (y - y0)), row_bytes);
+        }
+    }
+
+    bool close() override {
+        os.close();
+        if (!os) {
+            perror(path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// "Quite OK Image" format (qoiformat.org). The encoding of each pixel
+// depends on the ones before it, so it runs on one thread, but it's several
+// times faster than deflate.
+class QOIWriter : public ImageWriter {
+    struct Pixel {
+        uint8_t r, g, b, a;
+
+        bool operator==(const Pixel& other) const {
+            return r == other.r && g == other.g && b == other.b && a == other.a;
+        }
+        int hash() const {
+            return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+        }
+    };
+
+    std::ofstream os;
+    std::string path;
+    int width = 0, height = 0;
+    Pixel index[64] = {};
+    Pixel previous = { 0, 0, 0, 255 };
+    int run = 0;
+    std::vector<uint8_t> bytes;
+    std::vector<uint8_t> out;
+
+    void put32(uint32_t v) {
+        out.insert(out.end(), { uint8_t(v >> 24), uint8_t(v >> 16), uint8_t(v >> 8), uint8_t(v) });
+    }
+
+    void flush_run() {
+        if (run > 0) {
+            out.push_back(0xc0 | (run - 1));
+            run = 0;
+        }
+    }
+
+    void encode(const Pixel& px) {
+        if (px == previous) {
+            if (++run == 62) {
+                flush_run();
+            }
+            return;
+        }
+        flush_run();
+        const int h = px.hash();
+        if (index[h] == px) {
+            out.push_back(h);
+        } else {
+            index[h] = px;
+            const int dr = int8_t(px.r - previous.r);
+            const int dg = int8_t(px.g - previous.g);
+            const int db = int8_t(px.b - previous.b);
+            const int dr_dg = dr - dg, db_dg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                out.push_back(0x80 | (dg + 32));
+                out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+            } else {
+                out.insert(out.end(), { 0xfe, px.r, px.g, px.b });
+            }
+        }
+        previous = px;
+    }
+
+public:
+    bool open(const char* path, int width, int height) override {
+        this->path = path;
+        this->width = width;
+        this->height = height;
+        os.open(path, std::ios::binary);
+        if (!os) {
+            perror(path);
+            return false;
+        }
+        out.clear();
+        out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+        put32(width);
+        put32(height);
+        // RGB, and whether the values are sRGB encoded or all linear.
+        out.insert(out.end(), { 3, uint8_t(tonemap.srgb ? 0 : 1) });
+        return true;
+    }
+
+    void write_rows(int y0, int y1, const RGBF32* rgb) override {
+        const size_t n = size_t(width) * (y1 - y0);
+        bytes.resize(3 * n);
+        tone_map(tonemap, rgb, n, size_t(width) * y0, bytes.data());
+        for (size_t i = 0; i < n; i++) {
+            encode({ bytes[3 * i], bytes[3 * i + 1], bytes[3 * i + 2], 255 });
+        }
+        if (y1 == height) {
+            flush_run();
+            out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+        }
+        os.write(reinterpret_cast<const char*>(out.data()), out.size());
+        out.clear();
+    }
+
+    bool close() override {
+        os.close();
+        if (!os) {
+            perror(path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+#ifdef HAVE_ZLIB
+// 8-bit RGB PNG. Every band is filtered and compressed ROWS_PER_CHUNK rows
+// at a time in parallel, each chunk as its own deflate stream ending on a
+// byte boundary (Z_SYNC_FLUSH), the way pigz does it. Concatenated, they
+// make one valid zlib stream, with the checksums combined afterwards.
+class PNGWriter : public ImageWriter {
+    static constexpr int ROWS_PER_CHUNK = 8;
+    static constexpr int LEVEL = 6;
+
+    std::ofstream os;
+    std::string path;
+    int width = 0, height = 0;
+    // Last row of the previous band, for filtering the next one.
+    std::vector<uint8_t> previous_row;
+    uLong adler = 1;
+
+    void write_chunk(const char* type, const uint8_t* data, size_t size) {
+        const uint8_t length[4] = { uint8_t(size >> 24), uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size) };
+        os.write(reinterpret_cast<const char*>(length), 4);
+        os.write(type, 4);
+        os.write(reinterpret_cast<const char*>(data), size);
+        uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+        // A null buffer would reset the CRC.
+        if (size > 0) {
+            crc = crc32(crc, data, size);
+        }
+        const uint8_t crc_bytes[4] = { uint8_t(crc >> 24), uint8_t(crc >> 16), uint8_t(crc >> 8), uint8_t(crc) };
+        os.write(reinterpret_cast<const char*>(crc_bytes), 4);
+    }
+
+    static uint8_t paeth(int a, int b, int c) {
+        const int p = a + b - c;
+        const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+
+    // One filter type byte plus the Paeth-filtered row.
+    static void filter_row(const uint8_t* row, const uint8_t* above, size_t n, uint8_t* out) {
+        out[0] = 4;
+        for (size_t i = 0; i < n; i++) {
+            const int a = i >= 3 ? row[i - 3] : 0;
+            const int c = i >= 3 ? above[i - 3] : 0;
+            out[i + 1] = row[i] - paeth(a, above[i], c);
+        }
+    }
+
+public:
+    bool open(const char* path, int width, int height) override {
+        this->path = path;
+        this->width = width;
+        this->height = height;
+        previous_row.assign(3 * size_t(width), 0);
+        adler = adler32(0, nullptr, 0);
+        os.open(path, std::ios::binary);
+        if (!os) {
+            perror(path);
+            return false;
+        }
+        os.write("\x89PNG\r\n\x1a\n", 8);
+        const uint8_t header[13] = {
+            uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+            uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height),
+            8, 2, 0, 0, 0, // 8 bits, RGB, deflate, adaptive filtering, no interlace
+        };
+        write_chunk("IHDR", header, sizeof(header));
+        if (tonemap.srgb) {
+            const uint8_t intent = 0; // perceptual
+            write_chunk("sRGB", &intent, 1);
+        }
+        const uint8_t zlib_header[2] = { 0x78, 0x9c };
+        write_chunk("IDAT", zlib_header, 2);
+        return true;
+    }
+
+    void write_rows(int y0, int y1, const RGBF32* rgb) override {
+        const size_t row_bytes = 3 * size_t(width);
+        const int rows = y1 - y0;
+        // The band's rows as bytes, after the last row of the previous band.
+        std::vector<uint8_t> pixels(row_bytes * (rows + 1));
+        std::copy(previous_row.begin(), previous_row.end(), pixels.begin());
+        tbb::parallel_for(0, rows, [&](int r) {
+            tone_map(tonemap, rgb + size_t(width) * r, width, size_t(width) * (y0 + r),
+                     &pixels[row_bytes * (r + 1)]);
+        });
+
+        struct Chunk {
+            std::vector<uint8_t> data;
+            uLong adler;
+            uLong length;
+        };
+        const int chunks = (rows + ROWS_PER_CHUNK - 1) / ROWS_PER_CHUNK;
+        std::vector<Chunk> compressed(chunks);
+        tbb::parallel_for(0, chunks, [&](int chunk) {
+            const int first = chunk * ROWS_PER_CHUNK;
+            const int last = std::min(rows, first + ROWS_PER_CHUNK);
+            std::vector<uint8_t> filtered((row_bytes + 1) * (last - first));
+            for (int r = first; r < last; r++) {
+                filter_row(&pixels[(r + 1) * row_bytes], &pixels[r * row_bytes], row_bytes,
+                           &filtered[(r - first) * (row_bytes + 1)]);
+            }
+
+            Chunk& out = compressed[chunk];
+            out.adler = adler32(adler32(0, nullptr, 0), filtered.data(), filtered.size());
+            out.length = filtered.size();
+            z_stream z = {};
+            deflateInit2(&z, LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            out.data.resize(deflateBound(&z, filtered.size()) + 16);
+            z.next_in = filtered.data();
+            z.avail_in = filtered.size();
+            z.next_out = out.data.data();
+            z.avail_out = out.data.size();
+            // Only the end of the image finishes the stream.
+            deflate(&z, y0 + last == height ? Z_FINISH : Z_SYNC_FLUSH);
+            out.data.resize(z.total_out);
+            deflateEnd(&z);
+        });
+        std::copy_n(&pixels[rows * row_bytes], row_bytes, previous_row.begin());
+
+        for (const Chunk& chunk : compressed) {
+            adler = adler32_combine(adler, chunk.adler, chunk.length);
+            write_chunk("IDAT", chunk.data.data(), chunk.data.size());
+        }
+    }
+
+    bool close() override {
+        const uint8_t checksum[4] = { uint8_t(adler >> 24), uint8_t(adler >> 16), uint8_t(adler >> 8), uint8_t(adler) };
+        write_chunk("IDAT", checksum, 4);
+        write_chunk("IEND", nullptr, 0);
+        os.close();
+        if (!os) {
+            perror(path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+#endif
+
+// Backend for a file name's extension, or null (after printing why) if
+// there is none.
+inline std::unique_ptr<ImageWriter> make_image_writer(const char* path, const ToneMapSettings& tonemap = {}) {
+    const std::string_view name = path;
+    const auto dot = name.rfind('.');
+    const std::string_view ext = dot == std::string_view::npos ? "" : name.substr(dot + 1);
+    std::unique_ptr<ImageWriter> writer;
+    if (ext == "ppm") {
+        writer = std::make_unique<PPMWriter>();
+    } else if (ext == "pfm") {
+        writer = std::make_unique<PFMWriter>();
+    } else if (ext == "qoi") {
+        writer = std::make_unique<QOIWriter>();
+#ifdef HAVE_ZLIB
+    } else if (ext == "png") {
+        writer = std::make_unique<PNGWriter>();
+#endif
+    }
+    if (writer) {
+        writer->tonemap = tonemap;
+        return writer;
+    }
+    fprintf(stderr, "%s: unsupported image format, use .ppm, .pfm, .qoi"
+#ifdef HAVE_ZLIB
+            " or .png"
+#endif
+            "\n", path);
+    return nullptr;
+}
+
+// Collects tiles as the renderer finishes them and writes each frame on a
+// thread of its own, so that encoding overlaps with rendering. Rows are
+// handed to the backend as soon as every tile covering them is in, so most
+// of a frame is written before its last tile is done. Frames are written in
+// order; the next frame can be rendered while the previous one is still
+// being written.
+class TileOutput {
+    struct Frame {
+        std::unique_ptr<ImageWriter> writer;
+        std::string path;
+        int width, height;
+        std::vector<RGBF32> rgb;
+        // Pixels finished in each row.
+        std::vector<int> row_pixels;
+        // Rows handed to the writer.
+        int written = 0;
+        bool ended = false;
+        bool ok = true;
+    };
+
+    std::mutex mutex;
+    std::condition_variable work;
+    std::condition_variable idle;
+    std::deque<std::unique_ptr<Frame>> frames;
+    // The frame tiles are added to.
+    Frame* current = nullptr;
+    bool stopping = false;
+    bool failed = false;
+    // Encoders run in here, so that they keep to the renderer's thread
+    // count even when no tiles are being rendered.
+    tbb::task_arena arena;
+    std::thread thread;
+
+    // Rows of the oldest frame that can be written now.
+    int ready_rows(const Frame& frame) const {
+        int end = frame.written;
+        while (end < frame.height && frame.row_pixels[end] == frame.width) {
+            end++;
+        }
+        return end;
+    }
+
+    void run() {
+        std::unique_lock lock(mutex);
+        while (true) {
+            work.wait(lock, [&] {
+                if (frames.empty()) {
+                    return stopping;
+                }
+                const Frame& frame = *frames.front();
+                return ready_rows(frame) > frame.written || (frame.ended && frame.written == frame.height);
+            });
+            if (frames.empty()) {
+                break;
+            }
+            Frame& frame = *frames.front();
+            const int begin = frame.written;
+            const int end = ready_rows(frame);
+            if (end > begin) {
+                lock.unlock();
+                arena.execute([&] {
+                    if (begin == 0) {
+                        frame.ok = frame.writer->open(frame.path.c_str(), frame.width, frame.height);
+                    }
+                    if (frame.ok) {
+                        frame.writer->write_rows(begin, end, &frame.rgb[size_t(frame.width) * begin]);
+                    }
+                });
+                lock.lock();
+                frame.written = end;
+            }
+            if (frame.ended && frame.written == frame.height) {
+                if (frame.ok) {
+                    frame.ok = arena.execute([&] { return frame.writer->close(); });
+                }
+                failed |= !frame.ok;
+                frames.pop_front();
+                idle.notify_all();
+            }
+        }
+    }
+
+public:
+    // threads is the most encoders may use, 0 for all cores.
+    explicit TileOutput(int threads = 0):
+        arena(threads > 0 ? threads : tbb::task_arena::automatic), thread([this] { run(); }) {}
+
+    ~TileOutput() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        work.notify_one();
+        thread.join();
+    }
+
+    // Start a frame that will be written to path, in the format its
+    // extension asks for. Returns false if the format isn't known.
+    bool begin_frame(const char* path, int width, int height, const ToneMapSettings& tonemap = {}) {
+        auto frame = std::make_unique<Frame>();
+        frame->writer = make_image_writer(path, tonemap);
+        if (!frame->writer) {
+            return false;
+        }
+        frame->path = path;
+        frame->width = width;
+        frame->height = height;
+        frame->rgb.resize(size_t(width) * height);
+        frame->row_pixels.resize(height);
+        std::lock_guard lock(mutex);
+        current = frame.get();
+        frames.push_back(std::move(frame));
+        return true;
+    }
+
+    // Add a finished tile to the current frame, with pixel(x, y) giving the
+    // color of each pixel. Can be called from several threads at once, for
+    // different tiles.
+    template <typename F>
+    void add_tile(const Tile& tile, F&& pixel) {
+        Frame& frame = *current;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            RGBF32* out = &frame.rgb[size_t(frame.width) * y];
+            for (int x = tile.x0; x < tile.x1; x++) {
+                out[x] = pixel(x, y);
+            }
+        }
+        {
+            std::lock_guard lock(mutex);
+            for (int y = tile.y0; y < tile.y1; y++) {
+                frame.row_pixels[y] += tile.width();
+            }
+        }
+        work.notify_one();
+    }
+
+    // Every tile of the current frame has been added.
+    void end_frame() {
+        {
+            std::lock_guard lock(mutex);
+            current->ended = true;
+            current = nullptr;
+        }
+        work.notify_one();
+    }
+
+    // Wait for all frames to be written. Returns false if any failed.
+    bool finish() {
+        std::unique_lock lock(mutex);
+        idle.wait(lock, [&] { return frames.empty(); });
+        return !failed;
+    }
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "bench.h"
+#include "framebuf.h"
+
+struct ProgressiveSettings {
+    // Samples per pixel added by each pass.
+    int pass_samples = 10;
+    // Stop once this many samples per pixel have been taken.
+    int max_samples = 100;
+    // Stop after this many seconds, if > 0.
+    double time_budget = 0;
+    // Stop when the estimated noise (see estimate_noise) drops below this,
+    // if > 0.
+    float noise_threshold = 0;
+    // If > 0, only pixels whose relative error is above this get more
+    // samples after the first pass, up to max_samples per pixel.
+    float adaptive_threshold = 0;
+};
+
+enum class StopReason { Samples, Time, Noise, Converged };
+
+inline std::ostream& operator<<(std::ostream& os, StopReason reason) {
+    switch (reason) {
+    case StopReason::Samples: return os << "sample count";
+    case StopReason::Time: return os << "time budget";
+    case StopReason::Noise: return os << "noise threshold";
+    case StopReason::Converged: return os << "convergence";
+    default: return os << static_cast<int>(reason);
+    }
+}
+
+struct ProgressiveResult {
+    int passes = 0;
+    int samples = 0;
+    // Samples taken over all pixels, which is less than samples times the
+    // number of pixels when sampling adaptively.
+    size_t total_samples = 0;
+    double seconds = 0;
+    float noise = INFINITY;
+    StopReason reason = StopReason::Samples;
+};
+
+// Standard error of the pixel's mean luminance relative to the mean. Very
+// dark pixels are compared to a small floor instead, since they have no
+// visible noise to speak of.
+inline float relative_error(const Accum& px) {
+    return std::sqrt(px.variance_of_mean()) / std::max(luminance(px.mean()), 0.01f);
+}
+
+// Average relative error of all pixels.
+inline float estimate_noise(const framebuf<Accum>& accum) {
+    double total = 0;
+    for (size_t y = 0; y < accum.height; y++) {
+        const Accum* line = accum.line(y);
+        for (size_t x = 0; x < accum.width; x++) {
+            total += relative_error(line[x]);
+        }
+    }
+    return total / (accum.width * accum.height);
+}
+
+// Decide which pixels get samples in the next pass: active[y * width + x]
+// is set for those that are below max_samples and, with adaptive sampling,
+// have not converged. A pixel counts as converged once the largest relative
+// error in its 3x3 neighbourhood is below the threshold, which is less
+// likely to stop early on a pixel that just hasn't hit a rare bright path
+// yet. Returns the number of active pixels.
+inline size_t select_pixels(const framebuf<Accum>& accum, const ProgressiveSettings& settings,
+                            std::vector<uint8_t>& active) {
+    const int width = accum.width, height = accum.height;
+    active.assign(size_t(width) * height, 0);
+    std::vector<float> error;
+    if (settings.adaptive_threshold > 0) {
+        error.resize(active.size());
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                error[y * width + x] = relative_error(accum.at(x, y));
+            }
+        }
+    }
+    size_t count = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (accum.at(x, y).samples >= uint32_t(settings.max_samples)) {
+                continue;
+            }
+            bool converged = !error.empty();
+            for (int ny = std::max(y - 1, 0); converged && ny <= std::min(y + 1, height - 1); ny++) {
+                for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++) {
+                    converged &= error[ny * width + nx] <= settings.adaptive_threshold;
+                }
+            }
+            if (!converged) {
+                active[y * width + x] = 1;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+// Call render_pass(pass, samples) to add up to `samples` samples per pixel
+// to accum until one of the stop criteria is reached. render_pass returns
+// the number of samples it took in total, and 0 means every pixel has
+// converged. on_pass(result) is
+// called after each pass, e.g. to save an intermediate image.
+template <typename F, typename G>
+ProgressiveResult render_progressive(framebuf<Accum>& accum, const ProgressiveSettings& settings,
+                                     F&& render_pass, G&& on_pass) {
+    ProgressiveResult result;
+    const double start = ns();
+    while (true) {
+        const int samples = std::min(settings.pass_samples, settings.max_samples - result.samples);
+        const size_t taken = render_pass(result.passes, samples);
+        if (taken == 0) {
+            result.reason = StopReason::Converged;
+            break;
+        }
+        result.passes++;
+        result.samples += samples;
+        result.total_samples += taken;
+        result.seconds = (ns() - start) * 1e-9;
+        if (settings.noise_threshold > 0) {
+            result.noise = estimate_noise(accum);
+        }
+        on_pass(result);
+
+        if (result.samples >= settings.max_samples) {
+            result.reason = StopReason::Samples;
+            break;
+        }
+        if (settings.time_budget > 0 && result.seconds >= settings.time_budget) {
+            result.reason = StopReason::Time;
+            break;
+        }
+        if (settings.noise_threshold > 0 && result.noise <= settings.noise_threshold) {
+            result.reason = StopReason::Noise;
+            break;
+        }
+    }
+    result.seconds = (ns() - start) * 1e-9;
+    return result;
+}
+
+// Number of samples taken for each pixel, relative to max_samples, for
+// viewing as a greyscale heatmap.
+inline void sample_map(const framebuf<Accum>& accum, int max_samples, framebuf<Z32>& out) {
+    for (size_t y = 0; y < accum.height; y++) {
+        for (size_t x = 0; x < accum.width; x++) {
+            out.at(x, y) = float(accum.at(x, y).samples) / max_samples;
+        }
+    }
+}
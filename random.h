@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Finalizer from SplitMix64, for seeding and hashing.
+inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// Small integer hash (from PCG), good enough to turn counters into random
+// bits.
+inline uint32_t hash32(uint32_t x) {
+    const uint32_t state = x * 747796405u + 2891336453u;
+    const uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+    return (word >> 22) ^ word;
+}
+
+inline uint32_t hash32(uint32_t a, uint32_t b) {
+    return hash32(a ^ hash32(b));
+}
+
+inline uint32_t hash32(uint32_t a, uint32_t b, uint32_t c) {
+    return hash32(a ^ hash32(b ^ hash32(c)));
+}
+
+// Uniform float in [0, 1) from the top 24 bits.
+inline float to_unit_float(uint32_t bits) {
+    return (bits >> 8) * 0x1p-24f;
+}
+
+// Counter-based random number: the same (seed, index, dimension) always
+// gives the same number, regardless of how the work was split up.
+inline float random_float(uint32_t seed, uint32_t index, uint32_t dimension) {
+    return to_unit_float(hash32(seed, index, dimension));
+}
+
+// xoshiro128+ with LANES independent streams in structure-of-arrays form,
+// so that fill() generates LANES numbers per step in vector registers.
+// Single numbers are taken from the first stream. Meets the requirements of
+// UniformRandomBitGenerator, so it also works with <random>.
+class Random {
+public:
+    static constexpr size_t LANES = 8;
+    using result_type = uint32_t;
+
+    Random(uint64_t seed = 0) {
+        this->seed(seed);
+    }
+
+    // Generator for one sample of one pixel.
+    Random(uint64_t seed, uint32_t pixel, uint32_t sample):
+        Random(seed ^ splitmix64((uint64_t(pixel) << 32) | sample))
+    {}
+
+    void seed(uint64_t seed) {
+        for (size_t lane = 0; lane < LANES; lane++) {
+            for (size_t i = 0; i < 2; i++) {
+                // A zero state would get stuck, but splitmix64 only returns 0
+                // for one input.
+                seed = splitmix64(seed);
+                s[2 * i][lane] = seed;
+                s[2 * i + 1][lane] = seed >> 32;
+            }
+        }
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    result_type operator()() {
+        return step(0);
+    }
+
+    // Uniform float in [0, 1).
+    float uniform() {
+        return to_unit_float(step(0));
+    }
+
+    // Fill out[0..n) with uniform floats in [0, 1).
+    void fill(float* __restrict out, size_t n) {
+        size_t i = 0;
+        for (; i + LANES <= n; i += LANES) {
+            for (size_t lane = 0; lane < LANES; lane++) {
+                out[i + lane] = to_unit_float(step(lane));
+            }
+        }
+        for (size_t lane = 0; i < n; i++, lane++) {
+            out[i] = to_unit_float(step(lane));
+        }
+    }
+
+private:
+    alignas(32) uint32_t s[4][LANES];
+
+    static uint32_t rotl(uint32_t x, int k) {
+        return (x << k) | (x >> (32 - k));
+    }
+
+    uint32_t step(size_t lane) {
+        const uint32_t result = s[0][lane] + s[3][lane];
+        const uint32_t t = s[1][lane] << 9;
+        s[2][lane] ^= s[0][lane];
+        s[3][lane] ^= s[1][lane];
+        s[1][lane] ^= s[2][lane];
+        s[0][lane] ^= s[3][lane];
+        s[2][lane] ^= t;
+        s[3][lane] = rotl(s[3][lane], 11);
+        return result;
+    }
+};
+
+inline float random_float(Random& rng) {
+    return rng.uniform();
+}
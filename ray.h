@@ -1,11 +1,14 @@
 #pragma once
 
+#include "vec.h"
+
 struct Ray {
     Point3 origin;
     Vec3 direction;
     Vec3 inverted_direction;
     Vec3 color;
 
+    Ray() = default;
     Ray(const Point3& origin, const Vec3& direction, const Vec3& color):
         origin(origin), direction(direction.norm()),
         inverted_direction(1 / direction.norm()),
@@ -27,6 +30,8 @@ struct HitRecord {
     Vec3 normal;
     // TODO We are very far from needing a whole 32 bits for this
     uint32_t id;
+    // Primitive within the object, for shapes made of several (meshes).
+    uint32_t prim = 0;
     bool front_face;
 
     bool is_hit() const {
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+#include "vec.h"
+#include "ray.h"
+
+// Structure-of-arrays bundle of N rays, for tracing many rays at once.
+template <size_t N>
+struct Rays {
+    alignas(64) float ox[N];
+    alignas(64) float oy[N];
+    alignas(64) float oz[N];
+
+    alignas(64) float dx[N];
+    alignas(64) float dy[N];
+    alignas(64) float dz[N];
+
+    alignas(64) float idx[N];
+    alignas(64) float idy[N];
+    alignas(64) float idz[N];
+
+    Vec3 origin(int i) const {
+        return { ox[i], oy[i], oz[i] };
+    }
+    Vec3 direction(int i) const {
+        return { dx[i], dy[i], dz[i] };
+    }
+
+    void set(int i, const Point3& o, const Vec3& d) {
+        ox[i] = o.x;
+        oy[i] = o.y;
+        oz[i] = o.z;
+        dx[i] = d.x;
+        dy[i] = d.y;
+        dz[i] = d.z;
+        idx[i] = 1 / d.x;
+        idy[i] = 1 / d.y;
+        idz[i] = 1 / d.z;
+    }
+
+    void set(int i, const Ray& ray) {
+        set(i, ray.origin, ray.direction);
+    }
+};
+
+template <size_t N>
+struct Hits {
+    alignas(64) float distance[N];
+    alignas(64) int id[N];
+    alignas(64) uint32_t prim[N];
+
+    void reset() {
+        std::fill_n(distance, N, INFINITY);
+        std::fill_n(id, N, -1);
+        std::fill_n(prim, N, 0);
+    }
+};
@@ -1,19 +1,288 @@
 #include "base.h"
 #include "framebuf.h"
+#include "output.h"
 #include "bench.h"
+#include "progressive.h"
 #include "scene.h"
+#include "tiles.h"
+#include "wavefront.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <chrono>
-#define __TBB_show_deprecation_message_task_H // Silence annoying TBB warning
-#include <execution>
+#include <string>
+#include <string_view>
 
-int main() {
+#include <tbb/enumerable_thread_specific.h>
+
+// Scatter copies of a mesh over the ground, each scaled to about the size
+// of the small spheres, turned at random and with its own color. rng is
+// shared by all the meshes, so that their copies don't land on each other.
+static void add_instances(Scene<Shape>& scene, const std::shared_ptr<const MeshData>& mesh, int count,
+                          Random& rng) {
+    const AABB& bounds = mesh->get_bounds();
+    const Vec3 size = bounds.get_size();
+    const float extent = std::max({ size.x, size.y, size.z });
+    const Point3 bottom_center((bounds.get_min().x + bounds.get_max().x) / 2, bounds.get_min().y,
+                               (bounds.get_min().z + bounds.get_max().z) / 2);
+    for (int i = 0; i < count; i++) {
+        const float scale = (0.3f + 0.3f * rng.uniform()) / extent;
+        const Vec3 position(22 * rng.uniform() - 11, 0, 22 * rng.uniform() - 11);
+        const float angle = float(2 * M_PI) * rng.uniform();
+        const Transform to_world = Transform::translate(position)
+            * Transform::rotate({ 0, 1, 0 }, angle)
+            * Transform::scale(scale)
+            * Transform::translate(-bottom_center);
+        const Vec3 color(rng.uniform(), rng.uniform(), rng.uniform());
+        scene.Add(Instance(mesh, to_world), Lambertian{ color * color });
+    }
+}
+
+// Small, bright lights hanging over the spheres.
+static void add_lights(Scene<Shape>& scene, int count) {
+    Random rng(~count);
+    for (int i = 0; i < count; i++) {
+        const Point3 center(16 * rng.uniform() - 8, 2 + 2 * rng.uniform(), 16 * rng.uniform() - 8);
+        scene.Add(Sphere{ center, 0.2f }, Emissive{ Vec3(1.0f, 0.85f, 0.6f) * 100 });
+    }
+}
+
+// The small spheres that move in an animation, circling the middle of the
+// scene. Everything else stays put.
+struct Animation {
+    struct Mover {
+        size_t id;
+        Sphere start;
+        // Turns per animation, either way round.
+        float turns;
+    };
+    std::vector<Mover> movers;
+
+    // Animate a fraction of the small spheres, chosen at random.
+    Animation(const Scene<Shape>& scene, float fraction) {
+        Random rng(0x5eed);
+        for (const auto& object : scene.objects) {
+            const auto* sphere = std::get_if<Sphere>(&object.shape);
+            if (sphere && sphere->radius < 0.5f && rng.uniform() < fraction) {
+                movers.push_back({ size_t(object.id), *sphere, rng.uniform() < 0.5f ? -1.0f : 1.0f });
+            }
+        }
+    }
+
+    // Place the movers where they are at time t, from 0 to 1.
+    void apply(Scene<Shape>& scene, float t) const {
+        for (const auto& mover : movers) {
+            const Transform turn = Transform::rotate({ 0, 1, 0 }, float(2 * M_PI) * mover.turns * t);
+            scene.SetShape(mover.id, Sphere{ turn.point(mover.start.center), mover.start.radius });
+        }
+    }
+};
+
+// Output file name for one frame of several: frame.ppm -> frame0007.ppm.
+static std::string numbered_path(const char* path, int frame) {
+    std::string numbered = path;
+    const size_t slash = numbered.rfind('/');
+    size_t dot = numbered.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = numbered.size();
+    }
+    char number[16];
+    snprintf(number, sizeof(number), "%04d", frame);
+    return numbered.insert(dot, number);
+}
+
+static void usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [--bvh median|sah] [--dump-bvh]"
+        " [--threads N] [--tile N] [--tile-order rows|morton|hilbert]"
+        " [--spp N] [--pass-spp N] [--time-budget S] [--noise T]"
+        " [--adaptive T] [--sample-map FILE] [--rr-depth N]"
+        " [--sampler independent|stratified|sobol|bluenoise]"
+        " [--scene FILE] [--bvh-cache FILE|none] [--mesh FILE]... [--instances N]"
+        " [--lights N] [--sky S] [--no-nee] [--output FILE.ppm|png|qoi|pfm]"
+        " [--exposure EV] [--srgb] [--dither]"
+        " [--frames N] [--moving F] [--rebuild-threshold T]\n";
+}
+
+int main(int argc, const char* argv[]) {
     const bool print_verts = false;
     constexpr int WIDTH = 1280, HEIGHT = 800;
 
-    const auto scene = generate_scene(WIDTH, HEIGHT);
+    BVHSplit bvh_split = BVHSplit::SAH;
+    bool dump_bvh = false;
+    int threads = 0;
+    int tile_size = 16;
+    TileOrder tile_order = TileOrder::Hilbert;
+    const int samples_per_pixel = 100;
+    const char* sample_map_path = nullptr;
+    const char* output_path = "frame.ppm";
+    ToneMapSettings tonemap;
+    int frames = 1;
+    float moving = 0.1f;
+    float rebuild_threshold = 1.5f;
+    int roulette_depth = 3;
+    SamplerType sampler_type = SamplerType::Sobol;
+    const char* scene_path = nullptr;
+    std::string bvh_cache_path;
+    std::vector<const char*> mesh_paths;
+    int instances = 0;
+    int lights = 0;
+    float sky_scale = 1;
+    bool next_event = true;
+    ProgressiveSettings progressive;
+    progressive.max_samples = samples_per_pixel;
+    progressive.pass_samples = 0;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        // Cleared by options with a value that isn't a number.
+        bool ok = true;
+        if (arg == "--bvh" && i + 1 < argc) {
+            const std::string_view value = argv[++i];
+            if (value == "median") {
+                bvh_split = BVHSplit::Median;
+            } else if (value == "sah") {
+                bvh_split = BVHSplit::SAH;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--dump-bvh") {
+            dump_bvh = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            ok = parse_number(argv[++i], threads);
+        } else if (arg == "--tile" && i + 1 < argc) {
+            ok = parse_number(argv[++i], tile_size, 1);
+        } else if (arg == "--tile-order" && i + 1 < argc) {
+            const std::string_view value = argv[++i];
+            if (value == "rows") {
+                tile_order = TileOrder::Rows;
+            } else if (value == "morton") {
+                tile_order = TileOrder::Morton;
+            } else if (value == "hilbert") {
+                tile_order = TileOrder::Hilbert;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--spp" && i + 1 < argc) {
+            ok = parse_number(argv[++i], progressive.max_samples, 1);
+        } else if (arg == "--pass-spp" && i + 1 < argc) {
+            ok = parse_number(argv[++i], progressive.pass_samples, 1);
+        } else if (arg == "--time-budget" && i + 1 < argc) {
+            ok = parse_number(argv[++i], progressive.time_budget);
+        } else if (arg == "--noise" && i + 1 < argc) {
+            ok = parse_number(argv[++i], progressive.noise_threshold);
+        } else if (arg == "--adaptive" && i + 1 < argc) {
+            ok = parse_number(argv[++i], progressive.adaptive_threshold);
+        } else if (arg == "--sampler" && i + 1 < argc) {
+            const std::string_view value = argv[++i];
+            if (value == "independent") {
+                sampler_type = SamplerType::Independent;
+            } else if (value == "stratified") {
+                sampler_type = SamplerType::Stratified;
+            } else if (value == "sobol") {
+                sampler_type = SamplerType::Sobol;
+            } else if (value == "bluenoise") {
+                sampler_type = SamplerType::BlueNoise;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--scene" && i + 1 < argc) {
+            scene_path = argv[++i];
+        } else if (arg == "--bvh-cache" && i + 1 < argc) {
+            bvh_cache_path = argv[++i];
+        } else if (arg == "--mesh" && i + 1 < argc) {
+            mesh_paths.push_back(argv[++i]);
+        } else if (arg == "--instances" && i + 1 < argc) {
+            ok = parse_number(argv[++i], instances, 0);
+        } else if (arg == "--lights" && i + 1 < argc) {
+            ok = parse_number(argv[++i], lights, 0);
+        } else if (arg == "--sky" && i + 1 < argc) {
+            ok = parse_number(argv[++i], sky_scale);
+        } else if (arg == "--no-nee") {
+            next_event = false;
+        } else if (arg == "--rr-depth" && i + 1 < argc) {
+            ok = parse_number(argv[++i], roulette_depth, 0);
+        } else if (arg == "--sample-map" && i + 1 < argc) {
+            sample_map_path = argv[++i];
+        } else if (arg == "--output" && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (arg == "--exposure" && i + 1 < argc) {
+            ok = parse_number(argv[++i], tonemap.exposure);
+        } else if (arg == "--srgb") {
+            tonemap.srgb = true;
+        } else if (arg == "--dither") {
+            tonemap.dither = true;
+        } else if (arg == "--frames" && i + 1 < argc) {
+            ok = parse_number(argv[++i], frames, 1);
+        } else if (arg == "--moving" && i + 1 < argc) {
+            ok = parse_number(argv[++i], moving);
+        } else if (arg == "--rebuild-threshold" && i + 1 < argc) {
+            ok = parse_number(argv[++i], rebuild_threshold);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!make_image_writer(output_path)) {
+        return 1;
+    }
+    // Whether the render can stop before max_samples, in which case the last
+    // pass isn't known until it is done.
+    const bool may_stop_early = progressive.time_budget > 0 || progressive.noise_threshold > 0;
+    if (progressive.pass_samples <= 0) {
+        // Without a pass size, render all samples in one pass unless one of
+        // the early stopping criteria needs intermediate results.
+        const bool early_stop = may_stop_early || progressive.adaptive_threshold > 0;
+        progressive.pass_samples = early_stop ? std::min(10, progressive.max_samples) : progressive.max_samples;
+    }
+
+    Scene<Shape> scene;
+    if (scene_path) {
+        if (!load_scene(scene_path, WIDTH, HEIGHT, scene)) {
+            return 1;
+        }
+        // Cache the BVH next to the scene unless told otherwise.
+        if (bvh_cache_path.empty()) {
+            bvh_cache_path = std::string(scene_path) + ".bvh";
+        }
+    } else {
+        scene = generate_scene(WIDTH, HEIGHT);
+    }
+    const bool use_bvh_cache = !bvh_cache_path.empty() && bvh_cache_path != "none";
+    Random instance_rng(instances);
+    for (const char* path : mesh_paths) {
+        const double start = ns();
+        auto mesh = MeshData::load(path, bvh_split, bvh_cache_path != "none");
+        if (!mesh) {
+            return 1;
+        }
+        std::cout << path << ": " << mesh->get_triangle_count() << " triangles, BVH "
+            << (mesh->bvh_from_cache() ? "loaded from cache" : "built") << ", "
+            << (ns() - start) * 1e-9 << " s\n";
+        if (instances > 0) {
+            add_instances(scene, mesh, instances, instance_rng);
+        } else {
+            scene.Add(Mesh{ std::move(mesh) }, Lambertian{ { 0.7f, 0.7f, 0.7f } });
+        }
+    }
+    add_lights(scene, lights);
+    scene.sky_scale = sky_scale;
+    if (scene.bvh.has_value() && mesh_paths.empty() && lights == 0) {
+        std::cout << "Scene BVH: loaded from " << scene_path << "\n";
+    } else {
+        const double start = ns();
+        const bool cached = scene.Finish(bvh_split, use_bvh_cache ? bvh_cache_path.c_str() : nullptr);
+        std::cout << "Scene BVH: " << (cached ? "loaded from " + bvh_cache_path : std::string("built"))
+            << " in " << (ns() - start) * 1e-9 << " s\n";
+    }
+    if (dump_bvh) {
+        scene.Dump();
+    }
     const auto& camera = scene.camera;
 
 #ifdef __SSE__
@@ -22,41 +291,208 @@ int main() {
     _mm_setcsr(_mm_getcsr() | 0x8040);
 #endif
 
-    framebuf<RGB24> buf(WIDTH, HEIGHT);
+    framebuf<Accum> accum(WIDTH, HEIGHT);
 
     const uint32_t master_seed = 0xdeadbeef;
     const int max_rays = 50;
-    const int samples_per_pixel = 100;
-    const float sample_weight = 1.0f / samples_per_pixel;
-    std::uniform_real_distribution<float> offset_dist_u(0, 1.0f / (WIDTH - 1));
-    std::uniform_real_distribution<float> offset_dist_v(0, 1.0f / (HEIGHT - 1));
-
-    // Dumb
-    std::vector<int> rows(HEIGHT);
-    std::iota(rows.begin(), rows.end(), 0);
-
-    double t = bench([&]() {
-        std::for_each(std::execution::par_unseq, rows.begin(), rows.end(),
-        [&](int y){
-            const float v = (HEIGHT - 1 - y) * (1.0f / (HEIGHT - 1));
-            // Seed each line to prepare for parallelism
-            Random rng(master_seed ^ y);
-            for (int x = 0; x < WIDTH; x++) {
-                Vec3 sum{};
-                const float u = x * (1.0f / (WIDTH - 1));
-                for (int i = 0; i < samples_per_pixel; i++) {
-                    const float off_u = offset_dist_u(rng);
-                    const float off_v = offset_dist_v(rng);
-                    const auto ray = scene.camera.shoot_ray(u + off_u, v + off_v);
-                    //std::cout << "Tracing " << ray << std::endl;
-                    sum = sum + scene.trace(ray, rng, max_rays);
+
+    const Sampler sampler(sampler_type, master_seed, progressive.max_samples);
+    const auto tiles = make_tiles(WIDTH, HEIGHT, tile_size, tile_order);
+    // The arguments are stored by value, so pass the scene by reference.
+    tbb::enumerable_thread_specific<Wavefront<Scene<Shape>>> integrators(
+        std::cref(scene), sampler, max_rays, roulette_depth, next_event);
+
+    TileOutput output(threads);
+    std::string frame_path = frames > 1 ? numbered_path(output_path, 0) : output_path;
+    auto pixel_color = [&](int x, int y) {
+        return accum.at(x, y).mean();
+    };
+    auto write_frame = [&]() {
+        if (output.begin_frame(frame_path.c_str(), WIDTH, HEIGHT, tonemap)) {
+            output.add_tile(Tile{ 0, 0, WIDTH, HEIGHT }, pixel_color);
+            output.end_frame();
+        }
+    };
+
+    std::vector<uint8_t> active_pixels;
+    // Render the tile's active pixels, returning the samples taken.
+    auto render_tile = [&](int pass, int samples, const Tile& tile) {
+        // Only the pixels that still need samples are rendered, packed
+        // together so the integrator's batches stay full.
+        std::vector<uint32_t> active;
+        std::vector<Accum> sums;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                if (active_pixels[y * WIDTH + x]) {
+                    active.push_back((y - tile.y0) * tile.width() + (x - tile.x0));
+                    sums.push_back(accum.at(x, y));
                 }
-                buf.at(x, y) = sum * sample_weight;
+            }
+        }
+        if (active.empty()) {
+            return size_t(0);
+        }
+        const double start = STATS_ENABLED ? ns() : 0;
+        // Seed each tile by its position and the pass, so the image
+        // doesn't depend on the scheduling.
+        Random rng(master_seed, tile.y0 * WIDTH + tile.x0, pass);
+        auto& integrator = integrators.local();
+        integrator.render(active.size(), samples, [&](size_t i, int sample) {
+            const int x = tile.x0 + active[i] % tile.width();
+            const int y = tile.y0 + active[i] / tile.width();
+            // Number samples across passes, so that the sample values
+            // don't depend on how the samples were split into passes.
+            return sampler.sample_id(x, y, accum.at(x, y).samples + sample);
+        }, [&](const SampleId& id) {
+            const Vec2 jitter = sampler.get2(id, PIXEL_DIM);
+            const Vec2 lens = sampler.get2(id, LENS_DIM);
+            const float u = (id.x + jitter.x) * (1.0f / (WIDTH - 1));
+            const float v = (HEIGHT - 1 - id.y + jitter.y) * (1.0f / (HEIGHT - 1));
+            return scene.camera.shoot_ray(u, v, lens.x, lens.y);
+        }, sums.data(), rng);
+        for (size_t i = 0; i < active.size(); i++) {
+            accum.at(tile.x0 + active[i] % tile.width(), tile.y0 + active[i] / tile.width()) = sums[i];
+        }
+        if constexpr (STATS_ENABLED) {
+            thread_stats().busy_ns += ns() - start;
+        }
+        return active.size() * samples;
+    };
+
+    int samples_done = 0;
+    // Whether the final image was written tile by tile during the last pass.
+    bool streamed = false;
+    auto render_pass = [&](int pass, int samples) {
+        if (select_pixels(accum, progressive, active_pixels) == 0) {
+            return size_t(0);
+        }
+        // When the last pass is known up front, its tiles go to the output
+        // as they finish.
+        const bool last_pass = !may_stop_early && samples_done + samples >= progressive.max_samples
+            && output.begin_frame(frame_path.c_str(), WIDTH, HEIGHT, tonemap);
+        std::atomic<size_t> taken = 0;
+        for_each_tile(tiles, threads, [&](size_t, const Tile& tile) {
+            taken += render_tile(pass, samples, tile);
+            if (last_pass) {
+                output.add_tile(tile, pixel_color);
             }
         });
-    });
+        if (last_pass) {
+            output.end_frame();
+            streamed = true;
+        }
+        samples_done += samples;
+        return taken.load();
+    };
+
+    ProgressiveResult result;
+    double frame_ns = 0;
+    // Returns the time taken, without the intermediate images, which would
+    // otherwise be counted again on every repetition of the benchmark.
+    auto render_frame = [&]() {
+        const double start = ns();
+        double intermediate_ns = 0;
+        accum.fill(Accum());
+        samples_done = 0;
+        streamed = false;
+        for (auto& integrator : integrators) {
+            integrator.reset_stats();
+        }
+        reset_render_stats();
+        result = render_progressive(accum, progressive, render_pass, [&](const ProgressiveResult& pass) {
+            // Make the intermediate image available after each pass.
+            if (pass.samples < progressive.max_samples) {
+                const double write_start = ns();
+                write_frame();
+                intermediate_ns += ns() - write_start;
+            }
+        });
+        if (!streamed) {
+            write_frame();
+        }
+        frame_ns = ns() - start - intermediate_ns;
+        return frame_ns;
+    };
+
+    double t = 0;
+    if (frames == 1) {
+        t = bench(render_frame);
+    } else {
+        // Each frame is rendered once. Between frames the BVH is refit to
+        // the objects that moved, and only its degraded parts are rebuilt,
+        // or all of it with a threshold of 0.
+        const Animation animation(scene, moving);
+        std::cout << "Animation: " << frames << " frames, " << animation.movers.size() << " of "
+            << scene.objects.size() << " objects moving\n";
+        double refit_total = 0, rebuild_total = 0;
+        for (int frame = 0; frame < frames; frame++) {
+            frame_path = numbered_path(output_path, frame);
+            std::cout << "Frame " << frame << ": ";
+            if (frame > 0) {
+                animation.apply(scene, float(frame) / frames);
+                double start = ns();
+                if (rebuild_threshold > 0) {
+                    scene.RefitBVH();
+                    const double refit = (ns() - start) * 1e-9;
+                    start = ns();
+                    const auto stats = scene.RebuildBVH(bvh_split, rebuild_threshold);
+                    const double rebuild = (ns() - start) * 1e-9;
+                    std::cout << "refit " << refit << " s, rebuilt " << stats.subtrees << " subtrees ("
+                        << stats.items << " objects) in " << rebuild << " s, ";
+                    refit_total += refit;
+                    rebuild_total += rebuild;
+                } else {
+                    scene.Finish(bvh_split);
+                    const double rebuild = (ns() - start) * 1e-9;
+                    std::cout << "rebuilt in " << rebuild << " s, ";
+                    rebuild_total += rebuild;
+                }
+            }
+            const double render = render_frame();
+            std::cout << "SAH cost " << scene.bvh->sah_cost() << ", rendered in " << render * 1e-9 << " s\n";
+            t += render / frames;
+        }
+        std::cout << "BVH updates: refit " << refit_total << " s, rebuild " << rebuild_total << " s in total\n";
+    }
+    std::cout << "Threads: " << (threads > 0 ? threads : tbb::this_task_arena::max_concurrency())
+        << ", " << tiles.size() << " " << tile_size << "x" << tile_size << " tiles in " << tile_order << " order\n";
+    std::cout << "Passes: " << result.passes << " of " << progressive.pass_samples << " spp, "
+        << result.samples << " spp total, stopped by " << result.reason;
+    if (progressive.noise_threshold > 0) {
+        std::cout << " (noise " << result.noise << ")";
+    }
+    std::cout << "\n";
     std::cout << "Render speed: " << (t * 1e-9) << " s/frame\n";
-    std::cout << "Rays used: " << (WIDTH * HEIGHT * samples_per_pixel) << "\n";
+    std::cout << "Rays used: " << result.total_samples << " ("
+        << double(result.total_samples) / (WIDTH * HEIGHT) << " spp on average)\n";
+    size_t rays_traced = 0, paths_finished = 0, shadow_rays = 0;
+    for (const auto& integrator : integrators) {
+        rays_traced += integrator.get_rays_traced();
+        paths_finished += integrator.get_paths_finished();
+        shadow_rays += integrator.get_shadow_rays_traced();
+    }
+    std::cout << "Average path length: " << double(rays_traced) / paths_finished
+        << " rays (Russian roulette after " << roulette_depth << " bounces)\n";
+    if (!scene.lights.empty()) {
+        std::cout << "Lights: " << scene.lights.size() << ", " << double(shadow_rays) / paths_finished
+            << " shadow rays per path" << (next_event ? "" : " (light sampling off)") << "\n";
+    }
+    std::cout << "Sampler: " << sampler_type << "\n";
+    std::cout << "Ray-sphere kernel: " << sphere_kernel.name << "\n";
+    if constexpr (STATS_ENABLED) {
+        print_render_stats(std::cout, frame_ns, alternative_names(static_cast<const Material*>(nullptr)));
+    }
+
+    if (sample_map_path) {
+        framebuf<Z32> map(WIDTH, HEIGHT);
+        sample_map(accum, progressive.max_samples, map);
+        map.save_ppm(sample_map_path);
+    }
 
-    buf.save_ppm("frame.ppm");
+    // Whatever is left of the output once rendering is done.
+    const double output_start = ns();
+    const bool output_ok = output.finish();
+    std::cout << "Output: " << output_path << ", finished " << (ns() - output_start) * 1e-9
+        << " s after rendering\n";
+    return output_ok ? 0 : 1;
 }
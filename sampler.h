@@ -0,0 +1,415 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "base.h"
+#include "random.h"
+#include "vec.h"
+
+// Which sample of which pixel is being taken. Together with a dimension
+// number, this fully determines the sample values, so the image doesn't
+// depend on how the work is scheduled.
+struct SampleId {
+    uint16_t x, y;
+    uint32_t index;
+    // Hash of the pixel position, see Sampler::sample_id().
+    uint32_t seed;
+};
+
+// Dimensions used by the renderer. Dimensions are consumed in pairs.
+enum SampleDimension : uint32_t {
+    PIXEL_DIM = 0,
+    LENS_DIM = 2,
+    // Each bounce uses three pairs: the scatter direction, the material's
+    // extra number plus Russian roulette, and the direction to a light.
+    BOUNCE_DIM = 4,
+    DIMS_PER_BOUNCE = 6,
+};
+
+enum class SamplerType {
+    // Independent uniform random numbers.
+    Independent,
+    // Jittered samples in a sqrt(spp) x sqrt(spp) grid, shuffled
+    // independently for each pixel and dimension pair.
+    Stratified,
+    // Owen-scrambled 2D Sobol points, shuffled for each pixel and dimension
+    // pair.
+    Sobol,
+    // Blue-noise dithered rank-1 lattice: neighbouring pixels get well
+    // spread values, so the remaining error looks like high-frequency noise.
+    BlueNoise,
+};
+
+inline std::ostream& operator<<(std::ostream& os, SamplerType type) {
+    switch (type) {
+    case SamplerType::Independent: return os << "independent";
+    case SamplerType::Stratified: return os << "stratified";
+    case SamplerType::Sobol: return os << "sobol";
+    case SamplerType::BlueNoise: return os << "bluenoise";
+    default: return os << static_cast<int>(type);
+    }
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    return __builtin_bswap32(x);
+}
+
+// Hash-based Owen scrambling, from Burley, "Practical Hash-based Owen
+// Scrambling" (JCGT 2020). Each bit is flipped depending only on the bits
+// above it, which keeps the stratification of (0,m,2) point sets.
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// First two dimensions of the Sobol sequence, as 0.32 fixed point.
+inline uint32_t sobol_0(uint32_t index) {
+    return reverse_bits(index);
+}
+
+// The second dimension is linear over XOR in the index bits, so it can be
+// built from a table for each byte of the index instead of looping over all
+// 32 bits.
+struct Sobol1Tables {
+    uint32_t bytes[4][256] {};
+
+    constexpr Sobol1Tables() {
+        uint32_t columns[32] {};
+        uint32_t v = 1u << 31;
+        for (int bit = 0; bit < 32; bit++, v ^= v >> 1) {
+            columns[bit] = v;
+        }
+        for (int byte = 0; byte < 4; byte++) {
+            for (uint32_t value = 0; value < 256; value++) {
+                uint32_t result = 0;
+                for (int bit = 0; bit < 8; bit++) {
+                    if (value & (1 << bit)) {
+                        result ^= columns[byte * 8 + bit];
+                    }
+                }
+                bytes[byte][value] = result;
+            }
+        }
+    }
+};
+
+inline constexpr Sobol1Tables SOBOL_1_TABLES;
+
+inline uint32_t sobol_1(uint32_t index) {
+    const auto& t = SOBOL_1_TABLES.bytes;
+    return t[0][index & 0xff] ^ t[1][index >> 8 & 0xff] ^ t[2][index >> 16 & 0xff] ^ t[3][index >> 24];
+}
+
+// Element i of a pseudo-random permutation of [0, n), from Kensler,
+// "Correlated Multi-Jittered Sampling" (2013).
+inline uint32_t permute(uint32_t i, uint32_t n, uint32_t seed) {
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893d;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3f;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+// Blue-noise ranks for a tileable SIZE x SIZE texture, made with Ulichney's
+// void-and-cluster method.
+class BlueNoiseTile {
+public:
+    static constexpr int SIZE = 64;
+
+    static const BlueNoiseTile& get() {
+        static const BlueNoiseTile tile;
+        return tile;
+    }
+
+    // Value in [0, 1) for the texel at (x, y), wrapping around.
+    float at(uint32_t x, uint32_t y) const {
+        return values[(y % SIZE) * SIZE + x % SIZE];
+    }
+
+private:
+    static constexpr int N = SIZE * SIZE;
+    static constexpr int RADIUS = 6;
+    static constexpr float SIGMA = 1.5f;
+
+    // (rank + 0.5) / N for each texel.
+    std::vector<float> values;
+
+    // Gaussian-weighted density of set texels around each texel, on a
+    // torus.
+    struct Energy {
+        std::array<float, (2 * RADIUS + 1) * (2 * RADIUS + 1)> kernel;
+        std::vector<float> energy = std::vector<float>(N);
+        std::vector<uint8_t> set = std::vector<uint8_t>(N);
+
+        Energy() {
+            for (int dy = -RADIUS; dy <= RADIUS; dy++) {
+                for (int dx = -RADIUS; dx <= RADIUS; dx++) {
+                    kernel[(dy + RADIUS) * (2 * RADIUS + 1) + dx + RADIUS] =
+                        std::exp(-(dx * dx + dy * dy) / (2 * SIGMA * SIGMA));
+                }
+            }
+        }
+
+        void toggle(int i) {
+            set[i] ^= 1;
+            const float sign = set[i] ? 1 : -1;
+            const int x = i % SIZE, y = i / SIZE;
+            for (int dy = -RADIUS; dy <= RADIUS; dy++) {
+                for (int dx = -RADIUS; dx <= RADIUS; dx++) {
+                    const int j = ((y + dy) & (SIZE - 1)) * SIZE + ((x + dx) & (SIZE - 1));
+                    energy[j] += sign * kernel[(dy + RADIUS) * (2 * RADIUS + 1) + dx + RADIUS];
+                }
+            }
+        }
+
+        // Set texel with the highest energy.
+        int tightest_cluster() const {
+            int best = -1;
+            for (int i = 0; i < N; i++) {
+                if (set[i] && (best < 0 || energy[i] > energy[best])) {
+                    best = i;
+                }
+            }
+            return best;
+        }
+
+        // Unset texel with the lowest energy.
+        int largest_void() const {
+            int best = -1;
+            for (int i = 0; i < N; i++) {
+                if (!set[i] && (best < 0 || energy[i] < energy[best])) {
+                    best = i;
+                }
+            }
+            return best;
+        }
+    };
+
+    BlueNoiseTile(): values(N) {
+        std::vector<int> rank(N);
+        // Initial pattern: random points, then move the point in the tightest
+        // cluster to the largest void until that no longer changes anything.
+        Energy prototype;
+        Random rng(0x5eed);
+        const int initial = N / 10;
+        for (int count = 0; count < initial;) {
+            const int i = rng() % N;
+            if (!prototype.set[i]) {
+                prototype.toggle(i);
+                count++;
+            }
+        }
+        while (true) {
+            const int cluster = prototype.tightest_cluster();
+            prototype.toggle(cluster);
+            const int void_ = prototype.largest_void();
+            prototype.toggle(void_);
+            if (void_ == cluster) {
+                break;
+            }
+        }
+
+        // Ranks below the initial points: remove the tightest clusters.
+        Energy e = prototype;
+        for (int r = initial - 1; r >= 0; r--) {
+            const int i = e.tightest_cluster();
+            e.toggle(i);
+            rank[i] = r;
+        }
+        // The rest: fill the largest voids.
+        e = prototype;
+        for (int r = initial; r < N; r++) {
+            const int i = e.largest_void();
+            e.toggle(i);
+            rank[i] = r;
+        }
+
+        for (int i = 0; i < N; i++) {
+            values[i] = (rank[i] + 0.5f) / N;
+        }
+    }
+};
+
+// Sample ids and dimensions for a batch of samples, as structure of arrays
+// for Sampler::fill().
+struct SampleBatch {
+    std::vector<uint32_t> x, y, index, seed, dim;
+
+    void resize(size_t n) {
+        for (auto* v : { &x, &y, &index, &seed, &dim }) {
+            v->resize(n);
+        }
+    }
+
+    void set(size_t i, const SampleId& id, uint32_t dimension) {
+        x[i] = id.x;
+        y[i] = id.y;
+        index[i] = id.index;
+        seed[i] = id.seed;
+        dim[i] = dimension;
+    }
+};
+
+class Sampler {
+    SamplerType type;
+    uint32_t seed;
+    // Grid size for stratified sampling.
+    uint32_t strata;
+    const BlueNoiseTile* tile = nullptr;
+
+    static float to_float(uint32_t x) {
+        return (x >> 8) * 0x1p-24f;
+    }
+
+    static uint32_t pair_seed(uint32_t seed, uint32_t dim) {
+        return hash32(seed + dim * 0x9e3779b9);
+    }
+
+    // The generators are inlined into fill()'s loops so that they vectorize.
+    ALWAYS_INLINE static void independent(uint32_t seed, uint32_t index, uint32_t dim, float& x, float& y) {
+        const uint32_t h = hash32(pair_seed(seed, dim) ^ hash32(index));
+        x = to_float(h);
+        y = to_float(hash32(h));
+    }
+
+    ALWAYS_INLINE void stratified(uint32_t seed, uint32_t index, uint32_t dim, float& x, float& y) const {
+        // Each round of strata^2 samples covers the grid once.
+        const uint32_t cells = strata * strata;
+        const uint32_t round_seed = hash32(pair_seed(seed, dim), index / cells);
+        const uint32_t cell = permute(index % cells, cells, round_seed);
+        const uint32_t h = hash32(round_seed ^ hash32(cell));
+        x = (cell % strata + to_float(h)) / strata;
+        y = (cell / strata + to_float(hash32(h))) / strata;
+    }
+
+    ALWAYS_INLINE static void sobol(uint32_t seed, uint32_t index, uint32_t dim, float& x, float& y) {
+        const uint32_t s = pair_seed(seed, dim);
+        index = nested_uniform_scramble(index, s);
+        x = to_float(nested_uniform_scramble(sobol_0(index), hash32(s)));
+        y = to_float(nested_uniform_scramble(sobol_1(index), hash32(s + 1)));
+    }
+
+    ALWAYS_INLINE void blue_noise(uint32_t px, uint32_t py, uint32_t index, uint32_t dim, float& x, float& y) const {
+        // Cranley-Patterson rotation of the R2 sequence by two blue-noise
+        // values. Each dimension pair looks up the tile at its own offset.
+        const uint32_t offset = hash32(seed, dim);
+        const float bx = tile->at(px + (offset & 0xff), py + (offset >> 8 & 0xff));
+        const float by = tile->at(px + (offset >> 16 & 0xff), py + (offset >> 24));
+        // In 0.32 fixed point, so the sum wraps around for free.
+        x = to_float(uint32_t(bx * 0x1p32f) + index * 3242174889u);
+        y = to_float(uint32_t(by * 0x1p32f) + index * 2447445414u);
+    }
+
+public:
+    Sampler(SamplerType type, uint32_t seed, int samples_per_pixel):
+        type(type), seed(seed),
+        strata(std::max(1, int(std::ceil(std::sqrt(float(samples_per_pixel))))))
+    {
+        if (type == SamplerType::BlueNoise) {
+            tile = &BlueNoiseTile::get();
+        }
+    }
+
+    SamplerType get_type() const { return type; }
+
+    SampleId sample_id(int x, int y, uint32_t index) const {
+        return { uint16_t(x), uint16_t(y), index, hash32(seed, x | y << 16) };
+    }
+
+    // Values in [0, 1) for dimensions dim and dim + 1 of sample id, where dim
+    // is even.
+    Vec2 get2(const SampleId& id, uint32_t dim) const {
+        Vec2 v;
+        switch (type) {
+        case SamplerType::Independent:
+        default:
+            independent(id.seed, id.index, dim, v.x, v.y);
+            break;
+        case SamplerType::Stratified:
+            stratified(id.seed, id.index, dim, v.x, v.y);
+            break;
+        case SamplerType::Sobol:
+            sobol(id.seed, id.index, dim, v.x, v.y);
+            break;
+        case SamplerType::BlueNoise:
+            blue_noise(id.x, id.y, id.index, dim, v.x, v.y);
+            break;
+        }
+        return v;
+    }
+
+    // Like get2() for samples[0..n), with dimensions samples.dim[i] + offset.
+    // The loop for each sampler is simple enough to vectorize, except for
+    // the rejection loop in stratified sampling.
+    void fill(const SampleBatch& samples, size_t n, uint32_t offset, float* out_x, float* out_y) const {
+        fill(samples.x.data(), samples.y.data(), samples.index.data(), samples.seed.data(),
+             samples.dim.data(), n, offset, out_x, out_y);
+    }
+
+private:
+    void fill(const uint32_t* __restrict px, const uint32_t* __restrict py,
+              const uint32_t* __restrict index, const uint32_t* __restrict seed,
+              const uint32_t* __restrict dim, size_t n, uint32_t offset,
+              float* __restrict out_x, float* __restrict out_y) const {
+        switch (type) {
+        case SamplerType::Independent:
+        default:
+            for (size_t i = 0; i < n; i++) {
+                independent(seed[i], index[i], dim[i] + offset, out_x[i], out_y[i]);
+            }
+            break;
+        case SamplerType::Stratified:
+            for (size_t i = 0; i < n; i++) {
+                stratified(seed[i], index[i], dim[i] + offset, out_x[i], out_y[i]);
+            }
+            break;
+        case SamplerType::Sobol:
+            for (size_t i = 0; i < n; i++) {
+                sobol(seed[i], index[i], dim[i] + offset, out_x[i], out_y[i]);
+            }
+            break;
+        case SamplerType::BlueNoise:
+            for (size_t i = 0; i < n; i++) {
+                blue_noise(px[i], py[i], index[i], dim[i] + offset, out_x[i], out_y[i]);
+            }
+            break;
+        }
+    }
+};
@@ -1,6 +1,12 @@
 #include "scene.h"
+#include "scene_file.h"
 
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
 #include <random>
+#include <tuple>
 
 Scene<Shape> generate_scene(float width, float height) {
     Scene<Shape> scene;
@@ -11,7 +17,8 @@ Scene<Shape> generate_scene(float width, float height) {
     const CameraOrientation orientation
         { { 13, 2, 3 }, { 0, 0, 0 }, { 0, 1, 0 } };
 
-    scene.camera = Camera(orientation, 20.0f, width / height, 0.1f, 10.0f);
+    scene.camera_params = { orientation, 20.0f, 0.1f, 10.0f };
+    scene.camera = Camera(scene.camera_params, width / height);
 
     //scene.camera = { { 0, 0, 0 }, { 2.0f, 2.0f } };
 
@@ -46,6 +53,182 @@ Scene<Shape> generate_scene(float width, float height) {
     scene.Add(Sphere{ { 0, 1, 0  }, 1.0f }, Dielectric{ 1.5f });
     scene.Add(Sphere{ { -4, 1, 0 }, 1.0f }, Lambertian{ { 0.4f, 0.2f, 0.1f } });
     scene.Add(Sphere{ { 4, 1, 0  }, 1.0f }, Metal{ { 0.7f, 0.6f, 0.5f }, 0.0f });
-    scene.Finish();
     return scene;
 }
+
+static void store(const Vec3& v, float* out) {
+    out[0] = v.x;
+    out[1] = v.y;
+    out[2] = v.z;
+}
+
+static Vec3 load(const float* p) {
+    return { p[0], p[1], p[2] };
+}
+
+static SceneFileMaterial to_file_material(const Material& material) {
+    SceneFileMaterial m {};
+    if (const auto* lambertian = std::get_if<Lambertian>(&material)) {
+        m.type = SceneFileMaterialType::Lambertian;
+        store(lambertian->albedo, m.albedo);
+    } else if (const auto* metal = std::get_if<Metal>(&material)) {
+        m.type = SceneFileMaterialType::Metal;
+        store(metal->albedo, m.albedo);
+        m.param = metal->fuzziness;
+    } else if (const auto* emissive = std::get_if<Emissive>(&material)) {
+        m.type = SceneFileMaterialType::Emissive;
+        store(emissive->emission, m.albedo);
+    } else {
+        m.type = SceneFileMaterialType::Dielectric;
+        m.param = std::get<Dielectric>(material).refraction;
+    }
+    return m;
+}
+
+static bool from_file_material(const SceneFileMaterial& m, Material& material) {
+    const Vec3 albedo = load(m.albedo);
+    switch (m.type) {
+    case SceneFileMaterialType::Lambertian:
+        material = Lambertian{ albedo };
+        return true;
+    case SceneFileMaterialType::Metal:
+        material = Metal{ albedo, m.param };
+        return true;
+    case SceneFileMaterialType::Dielectric:
+        material = Dielectric{ m.param };
+        return true;
+    case SceneFileMaterialType::Emissive:
+        material = Emissive{ albedo };
+        return true;
+    }
+    return false;
+}
+
+bool save_scene(const char* path, const Scene<Shape>& scene, bool with_bvh) {
+    SceneFileHeader header {};
+    memcpy(header.magic, SceneFileHeader::MAGIC, 4);
+    header.version = SceneFileHeader::VERSION;
+    const CameraParams& camera = scene.camera_params;
+    store(camera.orientation.lookfrom, header.lookfrom);
+    store(camera.orientation.lookat, header.lookat);
+    store(camera.orientation.up, header.up);
+    header.vfov = camera.vfov;
+    header.aperture = camera.aperture;
+    header.focus_distance = camera.focus_distance;
+
+    // Objects that share a material share its table entry.
+    using MaterialKey = std::tuple<SceneFileMaterialType, float, float, float, float>;
+    std::map<MaterialKey, uint32_t> material_index;
+    std::vector<SceneFileMaterial> materials;
+    std::vector<SceneFileSphere> spheres;
+    spheres.reserve(scene.objects.size());
+    for (const auto& object : scene.objects) {
+        const auto* sphere = std::get_if<Sphere>(&object.shape);
+        if (!sphere) {
+            fprintf(stderr, "%s: only spheres can be saved in a scene file\n", path);
+            return false;
+        }
+        const SceneFileMaterial m = to_file_material(scene.materials[object.id]);
+        const MaterialKey key { m.type, m.albedo[0], m.albedo[1], m.albedo[2], m.param };
+        const auto [it, added] = material_index.emplace(key, materials.size());
+        if (added) {
+            materials.push_back(m);
+        }
+        SceneFileSphere s;
+        store(sphere->center, s.center);
+        s.radius = sphere->radius;
+        s.material = it->second;
+        spheres.push_back(s);
+    }
+    header.sphere_count = spheres.size();
+    header.material_count = materials.size();
+
+    ArrayRef<BVHNode> nodes;
+    ArrayRef<uint32_t> indices;
+    if (with_bvh && scene.bvh.has_value()) {
+        nodes = scene.bvh->get_nodes();
+        indices = scene.bvh->get_indices();
+    }
+    header.node_count = nodes.size();
+    header.index_count = indices.size();
+
+    std::ofstream os(path, std::ios::binary);
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    os.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(BVHNode));
+    os.write(reinterpret_cast<const char*>(spheres.data()), spheres.size() * sizeof(SceneFileSphere));
+    os.write(reinterpret_cast<const char*>(materials.data()), materials.size() * sizeof(SceneFileMaterial));
+    os.write(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(uint32_t));
+    if (!os) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+bool load_scene(const char* path, float width, float height, Scene<Shape>& scene) {
+    MappedFile file(path);
+    if (!file.valid()) {
+        return false;
+    }
+    SceneFileHeader header;
+    if (file.size() < sizeof(header)) {
+        fprintf(stderr, "%s: too short for a scene file\n", path);
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, SceneFileHeader::MAGIC, 4) != 0 || header.version != SceneFileHeader::VERSION) {
+        fprintf(stderr, "%s: not a version %u scene file\n", path, SceneFileHeader::VERSION);
+        return false;
+    }
+    const size_t nodes_offset = sizeof(header);
+    const size_t spheres_offset = nodes_offset + size_t(header.node_count) * sizeof(BVHNode);
+    const size_t materials_offset = spheres_offset + size_t(header.sphere_count) * sizeof(SceneFileSphere);
+    const size_t indices_offset = materials_offset + size_t(header.material_count) * sizeof(SceneFileMaterial);
+    const size_t expected = indices_offset + size_t(header.index_count) * sizeof(uint32_t);
+    if (file.size() != expected) {
+        fprintf(stderr, "%s: size %zu doesn't match header (%zu)\n", path, file.size(), expected);
+        return false;
+    }
+
+    std::vector<Material> materials(header.material_count);
+    const auto* file_materials = reinterpret_cast<const SceneFileMaterial*>(file.data() + materials_offset);
+    for (uint32_t i = 0; i < header.material_count; i++) {
+        if (!from_file_material(file_materials[i], materials[i])) {
+            fprintf(stderr, "%s: material %u has unknown type %u\n", path, i,
+                    static_cast<uint32_t>(file_materials[i].type));
+            return false;
+        }
+    }
+
+    scene = Scene<Shape>();
+    scene.objects.reserve(header.sphere_count);
+    const auto* spheres = reinterpret_cast<const SceneFileSphere*>(file.data() + spheres_offset);
+    for (uint32_t i = 0; i < header.sphere_count; i++) {
+        const SceneFileSphere& s = spheres[i];
+        if (s.material >= header.material_count) {
+            fprintf(stderr, "%s: sphere %u has material %u out of range\n", path, i, s.material);
+            return false;
+        }
+        scene.Add(Sphere{ load(s.center), s.radius }, materials[s.material]);
+    }
+
+    scene.camera_params = {
+        { load(header.lookfrom), load(header.lookat), load(header.up) },
+        header.vfov, header.aperture, header.focus_distance,
+    };
+    scene.camera = Camera(scene.camera_params, width / height);
+
+    if (header.node_count == 0) {
+        return true;
+    }
+    BVH<Scene<Shape>::Object> bvh(
+        { reinterpret_cast<const BVHNode*>(file.data() + nodes_offset), header.node_count },
+        { reinterpret_cast<const uint32_t*>(file.data() + indices_offset), header.index_count });
+    if (!bvh.validate(scene.objects.size())) {
+        fprintf(stderr, "%s: invalid BVH\n", path);
+        return false;
+    }
+    scene.Finish(std::move(bvh));
+    scene.bvh_file = std::move(file);
+    return true;
+}
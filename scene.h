@@ -10,11 +10,23 @@
 #include "camera.h"
 #include "material.h"
 #include "sphere.h"
+#include "mesh.h"
+#include "instance.h"
 #include "bvh.h"
+#include "bvh_cache.h"
+#include "mapped_file.h"
+#include "wide_bvh.h"
+#include "leaf_spheres.h"
 
-using Shape = std::variant<Sphere>;
+using Shape = std::variant<Sphere, Mesh, Instance>;
 
-using Material = std::variant<Metal, Dielectric, Lambertian>;
+using Material = std::variant<Metal, Dielectric, Lambertian, Emissive>;
+
+// Names of the alternatives of a variant like Material.
+template <typename... Ts>
+std::vector<const char*> alternative_names(const std::variant<Ts...>*) {
+    return { Ts::NAME... };
+}
 
 inline Vec3 sky_color(const Ray& ray) {
     auto dir = ray.direction.norm();
@@ -34,12 +46,19 @@ inline Vec3 norm_color(const HitRecord& hit)
 template<typename T>
 struct Scene {
     struct Object {
+        // The BVH's leaves are tested this many at a time by LeafSpheres.
+        static constexpr uint32_t LEAF_BLOCK = BVH_WIDTH;
+
         T shape;
-        // TODO Consider an index instead of the data?
-        Material material;
         int id;
 
-        Object(int id, const T& shape, const Material& material): shape(shape), material(material), id(id) {}
+        Object(int id, const T& shape): shape(shape), id(id) {}
+
+        // Whether LeafSpheres tests this object, others are tested on their
+        // own.
+        bool in_leaf_block() const {
+            return std::holds_alternative<Sphere>(shape);
+        }
 
         AABB get_bounds() const {
             return std::visit([&](const auto &shape) {
@@ -53,47 +72,197 @@ struct Scene {
             }, shape);
         }
 
+        // Spheres are tested inline, everything else out of line, to keep
+        // the BVH traversal loops small.
         void intersect(const Ray& ray, HitRecord& out) const {
+            if (const auto* sphere = std::get_if<Sphere>(&shape)) {
+                sphere->intersect(ray, out, id);
+            } else {
+                intersect_other(ray, out);
+            }
+        }
+
+        template <size_t N>
+        void intersect(const Rays<N>& rays, Hits<N>& out) const {
+            if (const auto* sphere = std::get_if<Sphere>(&shape)) {
+                sphere->intersect(rays, out, id);
+            } else {
+                intersect_other(rays, out);
+            }
+        }
+
+        template <typename R, typename H>
+        NOINLINE void intersect_other(const R& rays, H& out) const {
             std::visit([&](const auto &shape) {
-                shape.intersect(ray, out, id);
+                shape.intersect(rays, out, id);
+            }, shape);
+        }
+
+        bool occluded(const Ray& ray, float tmax) const {
+            if (const auto* sphere = std::get_if<Sphere>(&shape)) {
+                return sphere->occluded(ray, tmax);
+            }
+            return occluded_other(ray, tmax);
+        }
+
+        NOINLINE bool occluded_other(const Ray& ray, float tmax) const {
+            return std::visit([&](const auto &shape) {
+                return shape.occluded(ray, tmax);
             }, shape);
         }
     };
 
     std::vector<Object> objects;
-    // TODO BVH doesn't need to copy around materials and stuff...
+    // Indexed by object id, kept apart so that the BVH traversal doesn't
+    // drag materials through the cache.
+    std::vector<Material> materials;
     std::optional<BVH<Object>> bvh;
+    // Collapsed from bvh, used for tracing.
+    std::optional<WideBVH<Object>> wide_bvh;
+    // The spheres in the BVH's leaves, which is what the traversals test.
+    // In wide_bvh's index order, which is also bvh's, so leaf ranges from
+    // either index it.
+    LeafSpheres<> leaf_spheres;
 
+    CameraParams camera_params;
     Camera camera;
+    // Scales the sky's brightness, 0 to light the scene only with its
+    // Emissive objects.
+    float sky_scale = 1.0f;
+
+    // Spheres with Emissive materials, which the integrator samples
+    // directly.
+    struct Light {
+        Sphere sphere;
+        Vec3 emission;
+        // Index of the object.
+        int id;
+    };
+    std::vector<Light> lights;
+
+    // Holds the BVH when it was mapped from a scene or cache file.
+    MappedFile bvh_file;
 
     void Add(T shape, const Material& material)
     {
-        objects.emplace_back(objects.size(), shape, material);
+        objects.emplace_back(objects.size(), shape);
+        materials.push_back(material);
+        if (IsLight(objects.size() - 1)) {
+            lights.push_back({ std::get<Sphere>(shape), std::get<Emissive>(material).emission, objects.back().id });
+        }
+    }
+
+    // Move or reshape an object. The BVH needs RefitBVH or Finish after.
+    void SetShape(size_t id, const T& shape)
+    {
+        objects[id].shape = shape;
+        if (IsLight(id)) {
+            for (auto& light : lights) {
+                if (light.id == int(id)) {
+                    light.sphere = std::get<Sphere>(shape);
+                }
+            }
+        }
+    }
+
+    bool IsLight(size_t id) const {
+        return std::holds_alternative<Emissive>(materials[id])
+            && std::holds_alternative<Sphere>(objects[id].shape);
+    }
+
+    // Build the BVH, or use the one cached in cache_path if the geometry is
+    // the same as when it was saved there. Returns true if the cache was
+    // used.
+    bool Finish(BVHSplit split = BVHSplit::SAH, const char* cache_path = nullptr)
+    {
+        wide_bvh.reset();
+        bvh.reset();
+        BVH<Object> built;
+        const bool cached = build_bvh_cached(objects, split, cache_path, built, bvh_file);
+        bvh.emplace(std::move(built));
+        wide_bvh.emplace(*bvh);
+        leaf_spheres = LeafSpheres<>(wide_bvh->get_indices(), objects);
+        return cached;
     }
 
-    void Finish()
+    // Use a BVH that was built earlier for the same objects.
+    void Finish(BVH<Object>&& prebuilt)
     {
-        bvh = BVH(objects);
+        bvh.emplace(std::move(prebuilt));
+        wide_bvh.emplace(*bvh);
+        leaf_spheres = LeafSpheres<>(wide_bvh->get_indices(), objects);
+    }
+
+    // After objects moved: fit the BVH to their new bounds, keeping its
+    // structure. Call RebuildBVH after to make it usable.
+    void RefitBVH()
+    {
+        bvh->refit(BVH<Object>::item_bounds(objects));
+    }
+
+    // Rebuild the parts of a refitted BVH whose SAH cost has grown past
+    // threshold times what it was when they were built, then collapse it
+    // into the wide BVH again.
+    typename BVH<Object>::RebuildStats RebuildBVH(BVHSplit split, float threshold)
+    {
+        const auto stats = bvh->rebuild_degraded(BVH<Object>::item_bounds(objects),
+                                                 BVH<Object>::item_centers(objects), split, threshold,
+                                                 BVH<Object>::item_singles(objects));
+        wide_bvh.emplace(*bvh);
+        leaf_spheres = LeafSpheres<>(wide_bvh->get_indices(), objects);
+        return stats;
     }
 
     const Material& GetMaterialOfObject(size_t id) const {
-        return objects[id].material;
+        return materials[id];
     }
 
     template <typename S>
     NOINLINE void IntersectShape(HitRecord& out, const Ray& ray) const {
-        if (bvh.has_value()) {
-            bvh->intersect(ray, out);
+        if (wide_bvh.has_value()) {
+            const typename LeafSpheres<>::SimdRay simd_ray(ray);
+            wide_bvh->traverse(ray, out, [&](uint32_t first, uint32_t count) {
+                leaf_spheres.intersect(simd_ray, first, count, out);
+                if (leaf_spheres.has_others(first, count)) {
+                    IntersectOthers(ray, first, count, out);
+                }
+            });
+        } else if (bvh.has_value()) {
+            bvh->intersect(objects, ray, out);
         } else {
             for (const auto& object : objects) {
                 object.intersect(ray, out);
             }
         }
         if(out.is_hit()){
-            std::visit([&](const auto &shape) {
-                shape.set_normal(out, ray);
-            }, objects[out.id].shape);
+            SetNormal(out, ray);
+        }
+    }
+
+    // The items in a wide_bvh leaf that leaf_spheres leaves out.
+    NOINLINE void IntersectOthers(const Ray& ray, uint32_t first, uint32_t count, HitRecord& out) const {
+        const auto& indices = wide_bvh->get_indices();
+        for (uint32_t k = first; k < first + count; k++) {
+            if (leaf_spheres.is_other(k)) {
+                objects[indices[k]].intersect_other(ray, out);
+            }
+        }
+    }
+
+    NOINLINE bool OccludedOthers(const Ray& ray, uint32_t first, uint32_t count, float tmax) const {
+        const auto& indices = wide_bvh->get_indices();
+        for (uint32_t k = first; k < first + count; k++) {
+            if (leaf_spheres.is_other(k) && objects[indices[k]].occluded_other(ray, tmax)) {
+                return true;
+            }
         }
+        return false;
+    }
+
+    void SetNormal(HitRecord& hit, const Ray& ray) const {
+        std::visit([&](const auto &shape) {
+            shape.set_normal(hit, ray);
+        }, objects[hit.id].shape);
     }
 
     void Intersect(HitRecord& out, const Ray& ray) const {
@@ -101,44 +270,91 @@ struct Scene {
         // Plus for any other shapes we implement
     }
 
-    NOINLINE Vec3 mtl_color(const HitRecord& hit, const Ray& ray, Random& rng, int ttl) const
-    {
-        if (ttl > 0) {
-            const auto& mat = GetMaterialOfObject(hit.id);
-            auto [direction, color] =
-                std::visit([&](const auto &material){
-                    return material.scatter(hit, ray, rng);
-                }, mat);
-            // Minimum value required to affect output pixel value (I think).
-            constexpr float MIN_LIGHT = 1.0f / 255 / 100;
-            if (std::max(color.x, color.y) > MIN_LIGHT || color.z > MIN_LIGHT) {
-                return trace(Ray(hit.p, direction, color), rng, ttl - 1);
-            } else {
-                return color;
+    // Whether anything is hit closer than tmax, for shadow rays. Stops at
+    // the first hit found instead of looking for the closest one.
+    bool Occluded(const Ray& ray, float tmax) const {
+        if (wide_bvh.has_value()) {
+            const typename LeafSpheres<>::SimdRay simd_ray(ray);
+            return wide_bvh->traverse_any(ray, tmax, [&](uint32_t first, uint32_t count) {
+                return leaf_spheres.occluded(simd_ray, first, count, tmax)
+                    || (leaf_spheres.has_others(first, count) && OccludedOthers(ray, first, count, tmax));
+            });
+        } else if (bvh.has_value()) {
+            return bvh->occluded(objects, ray, tmax);
+        }
+        for (const auto& object : objects) {
+            if (object.occluded(ray, tmax)) {
+                return true;
             }
         }
-        return ray.color;
+        return false;
+    }
+
+    Vec3 SkyColor(const Ray& ray) const {
+        return sky_color(ray) * sky_scale;
+    }
+
+    ScatterResult Scatter(const HitRecord& hit, const Ray& ray, Random& rng) const {
+        return std::visit([&](const auto &material){
+            return material.scatter(hit, ray, rng);
+        }, GetMaterialOfObject(hit.id));
     }
 
-    // TODO Instead of recursing, have a way to output new rays?
-    NOINLINE Vec3 trace(const Ray& ray, Random& rng, int ttl) const {
-        HitRecord hit{};
-        Intersect(hit, ray);
-        if (hit.is_hit()) {
-            return mtl_color(hit, ray, rng, ttl);
+    // Intersect up to N rays as one packet through the BVH. Meant for
+    // coherent rays, like several camera samples for one pixel.
+    template <size_t N>
+    NOINLINE void Intersect(const Ray* rays, size_t count, HitRecord* out) const {
+        Rays<N> packet;
+        Hits<N> hits;
+        for (size_t i = 0; i < N; i++) {
+            packet.set(i, rays[i < count ? i : 0]);
         }
-        else {
-            return sky_color(ray);
+        hits.reset();
+        if (bvh.has_value()) {
+            const uint32_t active = count < 32 ? (1u << count) - 1 : ~0u;
+            const auto indices = bvh->get_indices();
+            bvh->traverse_packet(packet, hits, active, [&](uint32_t first, uint32_t count) {
+                if (!leaf_spheres.has_others(first, count)) {
+                    leaf_spheres.intersect(packet, hits, first, count);
+                    return;
+                }
+                for (uint32_t k = first; k < first + count; k++) {
+                    objects[indices[k]].intersect(packet, hits);
+                }
+            });
+        } else {
+            for (const auto& object : objects) {
+                object.intersect(packet, hits);
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            out[i] = HitRecord{};
+            if (hits.id[i] >= 0) {
+                out[i].distance = hits.distance[i];
+                out[i].id = hits.id[i];
+                out[i].prim = hits.prim[i];
+                SetNormal(out[i], rays[i]);
+            }
         }
     }
 
     void Dump(std::ostream& os = std::cout) const {
         if (bvh.has_value()) {
-            os << *bvh << "\n";
+            bvh->dump(os, objects);
+            if (wide_bvh.has_value()) {
+                wide_bvh->dump(os);
+            }
         } else {
             os << "No BVH present\n";
         }
     }
 };
 
+// Returns the scene without a BVH, call Finish to build one.
 Scene<Shape> generate_scene(float width, float height);
+
+// Read a scene file written by save_scene. Its BVH is used if it has one,
+// otherwise the scene still needs Finish. Returns false after printing why if the file can't be used.
+bool load_scene(const char* path, float width, float height, Scene<Shape>& scene);
+// Write a scene made of spheres, with its BVH if with_bvh is set.
+bool save_scene(const char* path, const Scene<Shape>& scene, bool with_bvh = true);
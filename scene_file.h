@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+
+#include "bvh.h"
+
+// Binary scene file: this header, then node_count BVHNodes, sphere_count
+// SceneFileSpheres, material_count SceneFileMaterials and index_count
+// uint32_t item indices for the BVH leaves, all in native byte order. The
+// BVH can be used straight from a memory mapping.
+struct SceneFileHeader {
+    static constexpr char MAGIC[4] = { 'R', 'T', 'S', 'C' };
+    static constexpr uint32_t VERSION = 1;
+
+    char magic[4];
+    uint32_t version;
+    uint32_t sphere_count;
+    uint32_t material_count;
+    // Both 0 if the file has no BVH.
+    uint32_t node_count;
+    uint32_t index_count;
+    // Camera parameters, see CameraParams.
+    float lookfrom[3];
+    float lookat[3];
+    float up[3];
+    float vfov;
+    float aperture;
+    float focus_distance;
+};
+static_assert(sizeof(SceneFileHeader) == 72);
+static_assert(sizeof(SceneFileHeader) % alignof(BVHNode) == 0);
+
+struct SceneFileSphere {
+    float center[3];
+    float radius;
+    // Index into the material table.
+    uint32_t material;
+};
+static_assert(sizeof(SceneFileSphere) == 20);
+
+enum class SceneFileMaterialType : uint32_t {
+    Lambertian,
+    Metal,
+    Dielectric,
+    // albedo is the emitted radiance.
+    Emissive,
+};
+
+struct SceneFileMaterial {
+    SceneFileMaterialType type;
+    float albedo[3];
+    // Fuzziness for metals, refraction index for dielectrics.
+    float param;
+};
+static_assert(sizeof(SceneFileMaterial) == 20);
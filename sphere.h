@@ -2,6 +2,8 @@
 
 #include "aabb.h"
 #include "ray.h"
+#include "rays.h"
+#include "sphere_kernels.h"
 #include "vec.h"
 
 struct Sphere {
@@ -26,6 +28,22 @@ struct Sphere {
         }
     }
 
+    bool occluded(const Ray &r, float tmax) const {
+        const Vec3 oc = r.origin - center;
+        const float half_b = dot(oc, r.direction);
+        const float c = oc.sqlen() - radius * radius;
+        const float discriminant = half_b * half_b - c;
+        const float distance = -half_b - std::sqrt(std::max(discriminant, 0.0f));
+        return discriminant >= 0 && distance >= 0 && distance < tmax;
+    }
+
+    // Intersect all N rays of a packet, with the SIMD kernel picked for
+    // this CPU.
+    template <size_t N>
+    void intersect(const Rays<N> &r, Hits<N> &out, int id) const {
+        intersect_spheres(ray_arrays(r, out), { &center.x, &center.y, &center.z, &radius, &id, 1 });
+    }
+
     void set_normal(HitRecord &out, const Ray &r) const {
         out.p = r.at(out.distance);
         out.set_normal(r, (out.p - center) / radius);
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "rays.h"
+
+// Ray-sphere kernels that test a tile of rays against a tile of spheres,
+// both in structure-of-arrays form, keeping the closest hit of each ray.
+// There is an 8-wide AVX2 and a 16-wide AVX-512 version, compiled for those
+// instruction sets whatever -march says, and the best one the CPU supports
+// is picked at startup.
+
+struct SphereArrays {
+    const float* cx, * cy, * cz;
+    const float* r;
+    const int* id;
+    size_t count;
+};
+
+struct RayArrays {
+    const float* ox, * oy, * oz;
+    const float* dx, * dy, * dz;
+    // Closest hit so far, updated in place. id is left alone for rays that
+    // don't hit anything closer.
+    float* distance;
+    int* id;
+    size_t count;
+};
+
+template <size_t N>
+RayArrays ray_arrays(const Rays<N>& rays, Hits<N>& hits, size_t count = N) {
+    return { rays.ox, rays.oy, rays.oz, rays.dx, rays.dy, rays.dz, hits.distance, hits.id, count };
+}
+
+// Rays from first on, one at a time. Also does the rays that don't fill a
+// whole vector in the SIMD kernels.
+inline void intersect_spheres_generic(const RayArrays& rays, const SphereArrays& spheres, size_t first = 0) {
+    for (size_t i = first; i < rays.count; i++) {
+        float closest = rays.distance[i];
+        int closest_id = rays.id[i];
+        for (size_t j = 0; j < spheres.count; j++) {
+            const float ocx = rays.ox[i] - spheres.cx[j];
+            const float ocy = rays.oy[i] - spheres.cy[j];
+            const float ocz = rays.oz[i] - spheres.cz[j];
+            const float half_b = ocx * rays.dx[i] + ocy * rays.dy[i] + ocz * rays.dz[i];
+            const float c = ocx * ocx + ocy * ocy + ocz * ocz - spheres.r[j] * spheres.r[j];
+            const float discriminant = half_b * half_b - c;
+            const float distance = -half_b - std::sqrt(std::max(discriminant, 0.0f));
+            const bool hit = discriminant >= 0 && distance >= 0 && distance < closest;
+            closest = hit ? distance : closest;
+            closest_id = hit ? spheres.id[j] : closest_id;
+        }
+        rays.distance[i] = closest;
+        rays.id[i] = closest_id;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void intersect_spheres_avx2(const RayArrays& rays, const SphereArrays& spheres) {
+    const size_t full = rays.count / 8 * 8;
+    const __m256 zero = _mm256_setzero_ps();
+    for (size_t i = 0; i < full; i += 8) {
+        const __m256 ox = _mm256_loadu_ps(rays.ox + i);
+        const __m256 oy = _mm256_loadu_ps(rays.oy + i);
+        const __m256 oz = _mm256_loadu_ps(rays.oz + i);
+        const __m256 dx = _mm256_loadu_ps(rays.dx + i);
+        const __m256 dy = _mm256_loadu_ps(rays.dy + i);
+        const __m256 dz = _mm256_loadu_ps(rays.dz + i);
+        __m256 closest = _mm256_loadu_ps(rays.distance + i);
+        __m256 closest_id = _mm256_loadu_ps(reinterpret_cast<const float*>(rays.id + i));
+        for (size_t j = 0; j < spheres.count; j++) {
+            const __m256 ocx = _mm256_sub_ps(ox, _mm256_set1_ps(spheres.cx[j]));
+            const __m256 ocy = _mm256_sub_ps(oy, _mm256_set1_ps(spheres.cy[j]));
+            const __m256 ocz = _mm256_sub_ps(oz, _mm256_set1_ps(spheres.cz[j]));
+            const __m256 half_b = _mm256_fmadd_ps(ocx, dx, _mm256_fmadd_ps(ocy, dy, _mm256_mul_ps(ocz, dz)));
+            const __m256 c = _mm256_fmadd_ps(ocx, ocx, _mm256_fmadd_ps(ocy, ocy,
+                _mm256_fmsub_ps(ocz, ocz, _mm256_set1_ps(spheres.r[j] * spheres.r[j]))));
+            const __m256 discriminant = _mm256_fmsub_ps(half_b, half_b, c);
+            const __m256 distance = _mm256_sub_ps(_mm256_sub_ps(zero, half_b),
+                                                  _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero)));
+            const __m256 hit = _mm256_and_ps(
+                _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ), _mm256_cmp_ps(distance, zero, _CMP_GE_OQ)),
+                _mm256_cmp_ps(distance, closest, _CMP_LT_OQ));
+            int id = spheres.id[j];
+            float id_bits;
+            memcpy(&id_bits, &id, sizeof(id));
+            closest = _mm256_blendv_ps(closest, distance, hit);
+            closest_id = _mm256_blendv_ps(closest_id, _mm256_set1_ps(id_bits), hit);
+        }
+        _mm256_storeu_ps(rays.distance + i, closest);
+        _mm256_storeu_ps(reinterpret_cast<float*>(rays.id + i), closest_id);
+    }
+    intersect_spheres_generic(rays, spheres, full);
+}
+
+// The last partial vector of rays is done with masked loads and stores.
+__attribute__((target("avx512f")))
+inline void intersect_spheres_avx512(const RayArrays& rays, const SphereArrays& spheres) {
+    const __m512 zero = _mm512_setzero_ps();
+    for (size_t i = 0; i < rays.count; i += 16) {
+        const __mmask16 lanes = rays.count - i >= 16 ? 0xffff : (1u << (rays.count - i)) - 1;
+        const __m512 ox = _mm512_maskz_loadu_ps(lanes, rays.ox + i);
+        const __m512 oy = _mm512_maskz_loadu_ps(lanes, rays.oy + i);
+        const __m512 oz = _mm512_maskz_loadu_ps(lanes, rays.oz + i);
+        const __m512 dx = _mm512_maskz_loadu_ps(lanes, rays.dx + i);
+        const __m512 dy = _mm512_maskz_loadu_ps(lanes, rays.dy + i);
+        const __m512 dz = _mm512_maskz_loadu_ps(lanes, rays.dz + i);
+        __m512 closest = _mm512_maskz_loadu_ps(lanes, rays.distance + i);
+        __m512i closest_id = _mm512_maskz_loadu_epi32(lanes, rays.id + i);
+        for (size_t j = 0; j < spheres.count; j++) {
+            const __m512 ocx = _mm512_sub_ps(ox, _mm512_set1_ps(spheres.cx[j]));
+            const __m512 ocy = _mm512_sub_ps(oy, _mm512_set1_ps(spheres.cy[j]));
+            const __m512 ocz = _mm512_sub_ps(oz, _mm512_set1_ps(spheres.cz[j]));
+            const __m512 half_b = _mm512_fmadd_ps(ocx, dx, _mm512_fmadd_ps(ocy, dy, _mm512_mul_ps(ocz, dz)));
+            const __m512 c = _mm512_fmadd_ps(ocx, ocx, _mm512_fmadd_ps(ocy, ocy,
+                _mm512_fmsub_ps(ocz, ocz, _mm512_set1_ps(spheres.r[j] * spheres.r[j]))));
+            const __m512 discriminant = _mm512_fmsub_ps(half_b, half_b, c);
+            const __m512 distance = _mm512_sub_ps(_mm512_sub_ps(zero, half_b),
+                                                  _mm512_sqrt_ps(_mm512_max_ps(discriminant, zero)));
+            const __mmask16 hit = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GE_OQ)
+                & _mm512_cmp_ps_mask(distance, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(distance, closest, _CMP_LT_OQ);
+            closest = _mm512_mask_mov_ps(closest, hit, distance);
+            closest_id = _mm512_mask_mov_epi32(closest_id, hit, _mm512_set1_epi32(spheres.id[j]));
+        }
+        _mm512_mask_storeu_ps(rays.distance + i, lanes, closest);
+        _mm512_mask_storeu_epi32(rays.id + i, lanes, closest_id);
+    }
+}
+
+using SphereKernel = void (*)(const RayArrays&, const SphereArrays&);
+
+struct SphereKernelInfo {
+    const char* name;
+    SphereKernel kernel;
+};
+
+inline void intersect_spheres_scalar(const RayArrays& rays, const SphereArrays& spheres) {
+    intersect_spheres_generic(rays, spheres);
+}
+
+// The kernels this CPU can run, best first.
+inline std::vector<SphereKernelInfo> supported_sphere_kernels() {
+    __builtin_cpu_init();
+    std::vector<SphereKernelInfo> kernels;
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back({ "avx512", intersect_spheres_avx512 });
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels.push_back({ "avx2", intersect_spheres_avx2 });
+    }
+    kernels.push_back({ "generic", intersect_spheres_scalar });
+    return kernels;
+}
+
+// The best supported kernel, or the one named by the RT_SIMD environment
+// variable, to try the others.
+inline SphereKernelInfo select_sphere_kernel() {
+    const auto kernels = supported_sphere_kernels();
+    if (const char* name = getenv("RT_SIMD")) {
+        for (const auto& kernel : kernels) {
+            if (strcmp(kernel.name, name) == 0) {
+                return kernel;
+            }
+        }
+        fprintf(stderr, "RT_SIMD=%s is not supported here, using %s\n", name, kernels.front().name);
+    }
+    return kernels.front();
+}
+
+inline const SphereKernelInfo sphere_kernel = select_sphere_kernel();
+
+inline void intersect_spheres(const RayArrays& rays, const SphereArrays& spheres) {
+    sphere_kernel.kernel(rays, spheres);
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <tbb/enumerable_thread_specific.h>
+
+// Render statistics, compiled in with -DRT_STATS (make STATS=1). Without
+// it the counting code is dead and optimized away. Each thread counts into
+// its own RenderStats, which are summed at the end of a frame.
+#ifdef RT_STATS
+constexpr bool STATS_ENABLED = true;
+#else
+constexpr bool STATS_ENABLED = false;
+#endif
+
+struct RenderStats {
+    // Rays at deeper bounces are counted in the last entry.
+    static constexpr size_t MAX_DEPTH = 16;
+    static constexpr size_t MAX_MATERIALS = 8;
+
+    // Rays traced, by number of bounces before them (0 for camera rays).
+    uint64_t rays[MAX_DEPTH] = {};
+    uint64_t shadow_rays = 0;
+    // Rays that left the scene.
+    uint64_t misses = 0;
+    // Hits by material type, in the order of the Material variant.
+    uint64_t material_hits[MAX_MATERIALS] = {};
+    // Over all BVHs, including the ones inside meshes.
+    uint64_t nodes_visited = 0;
+    uint64_t primitive_tests = 0;
+    // Time spent rendering tiles.
+    double busy_ns = 0;
+
+    void add_ray(size_t depth) {
+        rays[std::min(depth, MAX_DEPTH - 1)]++;
+    }
+
+    uint64_t total_rays() const {
+        uint64_t total = shadow_rays;
+        for (uint64_t count : rays) {
+            total += count;
+        }
+        return total;
+    }
+
+    RenderStats& operator+=(const RenderStats& other) {
+        for (size_t i = 0; i < MAX_DEPTH; i++) {
+            rays[i] += other.rays[i];
+        }
+        shadow_rays += other.shadow_rays;
+        misses += other.misses;
+        for (size_t i = 0; i < MAX_MATERIALS; i++) {
+            material_hits[i] += other.material_hits[i];
+        }
+        nodes_visited += other.nodes_visited;
+        primitive_tests += other.primitive_tests;
+        busy_ns += other.busy_ns;
+        return *this;
+    }
+};
+
+// One RenderStats per thread that has counted anything. Entries are reset
+// but never removed, so that the threads can keep pointers to them.
+inline tbb::enumerable_thread_specific<RenderStats> render_stats;
+
+inline RenderStats& thread_stats() {
+    static thread_local RenderStats* stats = &render_stats.local();
+    return *stats;
+}
+
+inline void reset_render_stats() {
+    for (auto& stats : render_stats) {
+        stats = RenderStats();
+    }
+}
+
+// Counts into a local and adds to the thread's field when it goes out of
+// scope, so that inner loops don't touch thread-local storage.
+class StatCounter {
+    uint64_t RenderStats::* field;
+    uint64_t count = 0;
+
+public:
+    explicit StatCounter(uint64_t RenderStats::* field): field(field) {}
+    StatCounter(const StatCounter&) = delete;
+    StatCounter& operator=(const StatCounter&) = delete;
+    ~StatCounter() {
+        if constexpr (STATS_ENABLED) {
+            thread_stats().*field += count;
+        }
+    }
+
+    void operator++() {
+        if constexpr (STATS_ENABLED) {
+            count++;
+        }
+    }
+    void operator+=(uint64_t n) {
+        if constexpr (STATS_ENABLED) {
+            count += n;
+        }
+    }
+};
+
+// Summary of the frame that took frame_ns, with material_names in the
+// order of the counts.
+inline void print_render_stats(std::ostream& os, double frame_ns, const std::vector<const char*>& material_names) {
+    RenderStats total;
+    for (const auto& stats : render_stats) {
+        total += stats;
+    }
+    const uint64_t rays = total.total_rays();
+    const double per_ray = rays ? 1.0 / rays : 0;
+    os << "Stats: " << rays << " rays (" << total.shadow_rays << " shadow), "
+        << total.nodes_visited * per_ray << " nodes and " << total.primitive_tests * per_ray
+        << " primitives tested per ray\n";
+    os << "  Rays by bounce:";
+    for (size_t depth = 0; depth < RenderStats::MAX_DEPTH; depth++) {
+        if (total.rays[depth]) {
+            os << " " << depth << (depth + 1 == RenderStats::MAX_DEPTH ? "+" : "") << ":" << total.rays[depth];
+        }
+    }
+    os << "\n  Hits by material:";
+    for (size_t i = 0; i < material_names.size() && i < RenderStats::MAX_MATERIALS; i++) {
+        os << " " << material_names[i] << ":" << total.material_hits[i];
+    }
+    os << " sky:" << total.misses << "\n";
+    os << "  Threads busy:";
+    for (const auto& stats : render_stats) {
+        os << " " << std::fixed << std::setprecision(1) << 100 * stats.busy_ns / frame_ns << "%";
+    }
+    os << std::defaultfloat << std::setprecision(6) << " of " << frame_ns * 1e-9 << " s\n";
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/global_control.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+    size_t pixels() const { return size_t(width()) * height(); }
+};
+
+enum class TileOrder {
+    Rows,
+    Morton,
+    Hilbert,
+};
+
+inline std::ostream& operator<<(std::ostream& os, TileOrder order) {
+    switch (order) {
+    case TileOrder::Rows: return os << "rows";
+    case TileOrder::Morton: return os << "morton";
+    case TileOrder::Hilbert: return os << "hilbert";
+    default: return os << static_cast<int>(order);
+    }
+}
+
+// Interleave the bits of x and y.
+inline uint64_t morton_code(uint32_t x, uint32_t y) {
+    auto spread = [](uint64_t v) {
+        v = (v | (v << 16)) & 0x0000ffff0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0f;
+        v = (v | (v << 2)) & 0x3333333333333333;
+        v = (v | (v << 1)) & 0x5555555555555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Distance of (x, y) along a Hilbert curve covering an n x n grid, where n
+// is a power of two.
+inline uint64_t hilbert_code(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        const uint32_t rx = (x & s) > 0;
+        const uint32_t ry = (y & s) > 0;
+        d += uint64_t(s) * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Split the frame into tiles of at most tile_size x tile_size pixels,
+// listed in the given order. Morton and Hilbert order keep consecutive
+// tiles close together on screen.
+inline std::vector<Tile> make_tiles(int width, int height, int tile_size, TileOrder order) {
+    const uint32_t tiles_x = (width + tile_size - 1) / tile_size;
+    const uint32_t tiles_y = (height + tile_size - 1) / tile_size;
+    uint32_t n = 1;
+    while (n < std::max(tiles_x, tiles_y)) {
+        n *= 2;
+    }
+
+    std::vector<std::pair<uint64_t, Tile>> keyed;
+    for (uint32_t ty = 0; ty < tiles_y; ty++) {
+        for (uint32_t tx = 0; tx < tiles_x; tx++) {
+            const int x0 = tx * tile_size;
+            const int y0 = ty * tile_size;
+            const Tile tile { x0, y0, std::min(width, x0 + tile_size), std::min(height, y0 + tile_size) };
+            uint64_t key = uint64_t(ty) * tiles_x + tx;
+            if (order == TileOrder::Morton) {
+                key = morton_code(tx, ty);
+            } else if (order == TileOrder::Hilbert) {
+                key = hilbert_code(n, tx, ty);
+            }
+            keyed.emplace_back(key, tile);
+        }
+    }
+    std::sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+
+    std::vector<Tile> tiles;
+    tiles.reserve(keyed.size());
+    for (const auto& [key, tile] : keyed) {
+        tiles.push_back(tile);
+    }
+    return tiles;
+}
+
+// Run func(tile_index, tile) for every tile on TBB's work-stealing
+// scheduler, with the given number of threads (0 for all cores). Each tile
+// is its own task, and neighbours in the list tend to stay on one thread
+// until another thread runs dry and steals them.
+template <typename F>
+void for_each_tile(const std::vector<Tile>& tiles, int threads, F&& func) {
+    std::optional<tbb::global_control> limit;
+    if (threads > 0) {
+        limit.emplace(tbb::global_control::max_allowed_parallelism, threads);
+    }
+    tbb::task_arena arena(threads > 0 ? threads : tbb::task_arena::automatic);
+    arena.execute([&] {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, tiles.size()),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for (size_t i = range.begin(); i < range.end(); i++) {
+                    func(i, tiles[i]);
+                }
+            }, tbb::simple_partitioner());
+    });
+}
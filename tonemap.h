@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "framebuf.h"
+#include "random.h"
+
+// How linear radiance is turned into 8-bit output.
+struct ToneMapSettings {
+    // In stops: each one doubles the brightness.
+    float exposure = 0;
+    // Encode with the sRGB curve, instead of storing linear values.
+    bool srgb = false;
+    // Round with noise instead of to nearest, which trades banding in
+    // smooth gradients for fine grain.
+    bool dither = false;
+};
+
+// The sRGB transfer curve for x in [0, 1]. The power segment is a
+// polynomial in sqrt(x), within 0.04 of an 8-bit step of the exact curve,
+// so that the loops below vectorize.
+inline float srgb_encode(float x) {
+    const float s = std::sqrt(x);
+    const float curve = -0.04222851f + s * (1.5751764f + s * (-1.8986455f + s * (3.8952881f
+        + s * (-4.9974240f + s * (3.4137347f + s * -0.94604927f)))));
+    return x <= 0.0031308f ? 12.92f * x : curve;
+}
+
+template <bool SRGB, bool DITHER>
+void tone_map_channels(const float* __restrict in, size_t count, float scale, uint32_t first,
+                       uint8_t* __restrict out) {
+    for (size_t i = 0; i < count; i++) {
+        float x = std::clamp(in[i] * scale, 0.0f, 1.0f);
+        if constexpr (SRGB) {
+            x = srgb_encode(x);
+        }
+        // Truncating after adding 0.5 rounds to nearest; adding a uniform
+        // random offset instead dithers without changing the mean.
+        const float offset = DITHER ? to_unit_float(hash32(first + uint32_t(i))) : 0.5f;
+        out[i] = uint8_t(x * 255 + offset);
+    }
+}
+
+// Convert n pixels to 8-bit RGB. first_pixel is the index of in[0] in the
+// image, so that the dither pattern doesn't depend on how the image was
+// split up.
+inline void tone_map(const ToneMapSettings& settings, const RGBF32* in, size_t n, size_t first_pixel,
+                     uint8_t* out) {
+    const float* channels = &in[0].r;
+    const float scale = std::exp2(settings.exposure);
+    const uint32_t first = 3 * first_pixel;
+    if (settings.srgb) {
+        if (settings.dither) {
+            tone_map_channels<true, true>(channels, 3 * n, scale, first, out);
+        } else {
+            tone_map_channels<true, false>(channels, 3 * n, scale, first, out);
+        }
+    } else {
+        if (settings.dither) {
+            tone_map_channels<false, true>(channels, 3 * n, scale, first, out);
+        } else {
+            tone_map_channels<false, false>(channels, 3 * n, scale, first, out);
+        }
+    }
+}
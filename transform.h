@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cmath>
+
+#include "vec.h"
+
+// Affine transform, stored as the top three rows of a 4x4 matrix.
+struct Transform {
+    float m[3][4];
+
+    static Transform identity() {
+        return {{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } }};
+    }
+
+    static Transform translate(const Vec3& t) {
+        return {{ { 1, 0, 0, t.x }, { 0, 1, 0, t.y }, { 0, 0, 1, t.z } }};
+    }
+
+    static Transform scale(float s) {
+        return {{ { s, 0, 0, 0 }, { 0, s, 0, 0 }, { 0, 0, s, 0 } }};
+    }
+
+    // Rotation by angle (radians) around a unit axis.
+    static Transform rotate(const Vec3& axis, float angle) {
+        const float c = std::cos(angle), s = std::sin(angle), t = 1 - c;
+        const float x = axis.x, y = axis.y, z = axis.z;
+        return {{
+            { t * x * x + c,     t * x * y - s * z, t * x * z + s * y, 0 },
+            { t * x * y + s * z, t * y * y + c,     t * y * z - s * x, 0 },
+            { t * x * z - s * y, t * y * z + s * x, t * z * z + c,     0 },
+        }};
+    }
+
+    // The transform that applies other first, then this.
+    Transform operator*(const Transform& other) const {
+        Transform r;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                r.m[i][j] = m[i][0] * other.m[0][j] + m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j]
+                    + (j == 3 ? m[i][3] : 0);
+            }
+        }
+        return r;
+    }
+
+    Transform inverse() const {
+        const float a = m[0][0], b = m[0][1], c = m[0][2];
+        const float d = m[1][0], e = m[1][1], f = m[1][2];
+        const float g = m[2][0], h = m[2][1], i = m[2][2];
+        const float A = e * i - f * h, B = f * g - d * i, C = d * h - e * g;
+        const float inv_det = 1 / (a * A + b * B + c * C);
+        Transform r {{
+            { A * inv_det, (c * h - b * i) * inv_det, (b * f - c * e) * inv_det, 0 },
+            { B * inv_det, (a * i - c * g) * inv_det, (c * d - a * f) * inv_det, 0 },
+            { C * inv_det, (b * g - a * h) * inv_det, (a * e - b * d) * inv_det, 0 },
+        }};
+        const Vec3 t = r.vector({ m[0][3], m[1][3], m[2][3] });
+        r.m[0][3] = -t.x;
+        r.m[1][3] = -t.y;
+        r.m[2][3] = -t.z;
+        return r;
+    }
+
+    Point3 point(const Point3& p) const {
+        return vector(p) + Vec3(m[0][3], m[1][3], m[2][3]);
+    }
+
+    Vec3 vector(const Vec3& v) const {
+        return {
+            m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z,
+        };
+    }
+
+    // Multiply by the transposed linear part. Applied to an inverse
+    // transform, this takes normals the other way.
+    Vec3 transpose_vector(const Vec3& v) const {
+        return {
+            m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+            m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+            m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z,
+        };
+    }
+};
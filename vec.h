@@ -5,6 +5,7 @@
 #include <random>
 
 #include "base.h"
+#include "random.h"
 
 // Structure: Vector2
 //
@@ -201,20 +202,67 @@ using Vec2 = Vector2;
 using Vec3 = Vector3;
 using Point3 = Vector3;
 
+template <typename RNG>
+inline float random_float(RNG& rng)
+{
+    return std::uniform_real_distribution<float>(0, 1)(rng);
+}
+
+// Uniformly distributed unit vector from two uniform numbers in [0, 1). The
+// sine is derived from the cosine, since GCC merges sin and cos of the same
+// angle into a sincos call, which keeps loops from vectorizing.
+inline void uniform_unit_vector(float u0, float u1, float& x, float& y, float& z)
+{
+    z = 1 - 2 * u0;
+    const float r = std::sqrt(std::max(0.0f, 1 - z * z));
+    const float c = std::cos(float(2 * M_PI) * u1);
+    const float s = std::sqrt(std::max(0.0f, 1 - c * c));
+    x = r * c;
+    y = r * (u1 < 0.5f ? s : -s);
+}
+
+// Uniformly distributed point in the unit ball: a uniform direction scaled
+// by the cube root of a uniform radius.
+inline void uniform_in_unit_sphere(float u0, float u1, float u2, float& x, float& y, float& z)
+{
+    uniform_unit_vector(u0, u1, x, y, z);
+    const float r = std::cbrt(u2);
+    x *= r;
+    y *= r;
+    z *= r;
+}
+
 template <typename RNG>
 inline Vec3 random_in_unit_sphere(RNG& rng)
 {
-    // Eww
-    while (true) {
-        auto p = Vec3::random(rng, -1, 1);
-        if (p.sqlen() <= 1) return p;
-    }
+    const float u0 = random_float(rng);
+    const float u1 = random_float(rng);
+    const float u2 = random_float(rng);
+    Vec3 p;
+    uniform_in_unit_sphere(u0, u1, u2, p.x, p.y, p.z);
+    return p;
 }
 
 template <typename RNG>
 inline Vec3 random_unit_vector(RNG& rng)
 {
-    return random_in_unit_sphere(rng).norm();
+    const float u0 = random_float(rng);
+    const float u1 = random_float(rng);
+    Vec3 v;
+    uniform_unit_vector(u0, u1, v.x, v.y, v.z);
+    return v;
+}
+
+// Two unit vectors that make an orthonormal basis with the unit vector w,
+// without branches (Duff et al., "Building an Orthonormal Basis,
+// Revisited", JCGT 2017).
+inline void orthonormal_basis(const Vec3& w, Vec3& t1, Vec3& t2)
+{
+    const float sign = std::copysign(1.0f, w.z);
+    const float a = -1 / (sign + w.z);
+    const float b = w.x * w.y * a;
+    t1 = Vec3(1 + sign * w.x * w.x * a, sign * b, -sign * w.x);
+    t2 = Vec3(b, sign + w.y * w.y * a, -w.y);
 }
 
 inline Vec3 reflect(const Vec3& v, const Vec3& n)
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <array>
+#include <utility>
+#include <vector>
+
+#include "sampler.h"
+#include "scene.h"
+
+// One path being traced. Its throughput is carried in ray.color, which is
+// what the materials scale when scattering.
+struct Path {
+    Ray ray;
+    uint32_t pixel;
+    int ttl;
+    SampleId sample;
+    // Light gathered so far by sampling lights directly.
+    Vec3 radiance;
+    // Whether the lights were sampled at the previous bounce. If so, their
+    // emission has been counted already when the path hits one.
+    bool lights_sampled = false;
+};
+
+// Shadow ray from a path's hit towards a point on a light. color is added
+// to the path's radiance if nothing is in between.
+struct ShadowRay {
+    Ray ray;
+    float distance;
+    uint32_t path;
+    Vec3 color;
+};
+
+// Index of T among the alternatives of the variant V.
+template <typename T, typename V>
+struct alternative_index;
+
+template <typename T, typename... Ts>
+struct alternative_index<T, std::variant<Ts...>> {
+    static constexpr size_t value = [] {
+        size_t i = 0;
+        ((std::is_same_v<T, Ts> ? false : (++i, true)) && ...);
+        return i;
+    }();
+};
+
+// Wavefront path tracer: instead of recursing per ray, a batch of paths
+// goes through separate stages (generate camera rays, intersect the whole
+// batch, shade the whole batch) and shading emits continuation rays into
+// the queue for the next round.
+template <typename S>
+class Wavefront {
+    const S& scene;
+    const Sampler& sampler;
+    const int max_rays;
+    // Number of bounces before Russian roulette starts.
+    const int roulette_depth;
+    // Sample the lights at diffuse hits (next-event estimation).
+    const bool next_event;
+
+    std::vector<Path> paths;
+    std::vector<Path> next;
+    std::vector<HitRecord> hits;
+    std::vector<ShadowRay> shadow_rays;
+    // Hits to shade, grouped by material type.
+    std::array<ShadeBatch, std::variant_size_v<Material>> batches;
+    SampleBatch samples;
+
+    // Rays traced and paths finished, for the average path length.
+    size_t rays_traced = 0;
+    size_t paths_finished = 0;
+    size_t shadow_rays_traced = 0;
+
+    static constexpr size_t DIFFUSE = alternative_index<Lambertian, Material>::value;
+    static_assert(std::variant_size_v<Material> <= RenderStats::MAX_MATERIALS);
+
+public:
+    // Upper bound on paths in flight, so the queues stay in cache.
+    static constexpr size_t BATCH_SIZE = 1024;
+    // Camera rays are intersected in packets of this many samples (4, 8 or
+    // 16).
+    static constexpr size_t PACKET_SIZE = 16;
+
+    Wavefront(const S& scene, const Sampler& sampler, int max_rays, int roulette_depth, bool next_event = true):
+        scene(scene), sampler(sampler), max_rays(max_rays), roulette_depth(roulette_depth),
+        next_event(next_event && !scene.lights.empty())
+    {
+        paths.reserve(BATCH_SIZE);
+        next.reserve(BATCH_SIZE);
+        hits.reserve(BATCH_SIZE);
+        shadow_rays.reserve(BATCH_SIZE);
+    }
+
+    // Trace `samples` paths for each of `pixels` pixels and add their
+    // colors to sums[pixel]. sample_id(pixel, sample) identifies each sample
+    // for the sampler, and camera_ray(sample_id) generates its camera ray.
+    template <typename F, typename G>
+    void render(size_t pixels, int samples, F&& sample_id, G&& camera_ray, Accum* sums, Random& rng) {
+        const size_t batch_pixels = std::max<size_t>(1, BATCH_SIZE / samples);
+        for (size_t first = 0; first < pixels; first += batch_pixels) {
+            const size_t last = std::min(pixels, first + batch_pixels);
+            generate(first, last, samples, sample_id, camera_ray);
+            intersect_coherent();
+            shade(sums, rng);
+            while (!paths.empty()) {
+                intersect();
+                shade(sums, rng);
+            }
+        }
+    }
+
+    size_t get_rays_traced() const { return rays_traced; }
+    size_t get_paths_finished() const { return paths_finished; }
+    size_t get_shadow_rays_traced() const { return shadow_rays_traced; }
+    void reset_stats() {
+        rays_traced = 0;
+        paths_finished = 0;
+        shadow_rays_traced = 0;
+    }
+
+private:
+    template <typename F, typename G>
+    void generate(size_t first, size_t last, int samples, F&& sample_id, G&& camera_ray) {
+        paths.clear();
+        for (size_t pixel = first; pixel < last; pixel++) {
+            for (int i = 0; i < samples; i++) {
+                const SampleId id = sample_id(pixel, i);
+                paths.push_back({ camera_ray(id), uint32_t(pixel), max_rays, id, Vec3() });
+            }
+        }
+    }
+
+    // Camera rays for the same pixel are next to each other in the queue,
+    // trace them as packets.
+    void intersect_coherent() {
+        hits.resize(paths.size());
+        rays_traced += paths.size();
+        if constexpr (STATS_ENABLED) {
+            thread_stats().rays[0] += paths.size();
+        }
+        Ray rays[PACKET_SIZE];
+        for (size_t first = 0; first < paths.size(); first += PACKET_SIZE) {
+            const size_t count = std::min(PACKET_SIZE, paths.size() - first);
+            for (size_t i = 0; i < count; i++) {
+                rays[i] = paths[first + i].ray;
+            }
+            scene.template Intersect<PACKET_SIZE>(rays, count, &hits[first]);
+        }
+    }
+
+    void intersect() {
+        hits.resize(paths.size());
+        rays_traced += paths.size();
+        if constexpr (STATS_ENABLED) {
+            RenderStats& stats = thread_stats();
+            for (const Path& path : paths) {
+                stats.add_ray(max_rays - path.ttl);
+            }
+        }
+        for (size_t i = 0; i < paths.size(); i++) {
+            hits[i] = HitRecord{};
+            scene.Intersect(hits[i], paths[i].ray);
+        }
+    }
+
+    void shade(Accum* sums, Random& rng) {
+        for (auto& batch : batches) {
+            batch.clear();
+        }
+        if constexpr (STATS_ENABLED) {
+            RenderStats& stats = thread_stats();
+            for (const HitRecord& hit : hits) {
+                if (hit.is_hit()) {
+                    stats.material_hits[scene.GetMaterialOfObject(hit.id).index()]++;
+                } else {
+                    stats.misses++;
+                }
+            }
+        }
+        for (size_t i = 0; i < paths.size(); i++) {
+            const Path& path = paths[i];
+            const HitRecord& hit = hits[i];
+            if (!hit.is_hit()) {
+                sums[path.pixel].add(path.radiance + scene.SkyColor(path.ray));
+                continue;
+            }
+            const Material& material = scene.GetMaterialOfObject(hit.id);
+            if (const auto* emissive = std::get_if<Emissive>(&material)) {
+                const bool counted = path.lights_sampled && scene.IsLight(hit.id);
+                sums[path.pixel].add(path.radiance + (counted ? Vec3() : path.ray.color * emissive->emission));
+                continue;
+            }
+            if (path.ttl <= 0) {
+                sums[path.pixel].add(path.radiance + path.ray.color);
+                continue;
+            }
+            ShadeBatch& batch = batches[material.index()];
+            const size_t lane = batch.add(i, hit, path.ray);
+            std::visit([&](const auto& material) {
+                material.gather(batch, lane);
+            }, material);
+        }
+
+        scatter(rng, std::make_index_sequence<std::variant_size_v<Material>>());
+        if (next_event) {
+            sample_lights(batches[DIFFUSE]);
+        }
+
+        next.clear();
+        for (const auto& batch : batches) {
+            for (size_t i = 0; i < batch.size; i++) {
+                const Path& path = paths[batch.path[i]];
+                Vec3 color { batch.r[i], batch.g[i], batch.b[i] };
+                // Russian roulette: past the first few bounces, continue with
+                // a probability given by the throughput, and make up for the
+                // terminated paths by boosting the survivors. Terminated
+                // paths contribute nothing, which keeps the estimate
+                // unbiased.
+                if (max_rays - path.ttl >= roulette_depth) {
+                    const float survival = std::min(1.0f, std::max({ color.x, color.y, color.z }));
+                    if (batch.u3[i] >= survival) {
+                        sums[path.pixel].add(path.radiance);
+                        continue;
+                    }
+                    color = color / survival;
+                }
+                const Point3 p { batch.px[i], batch.py[i], batch.pz[i] };
+                const Vec3 direction { batch.dx[i], batch.dy[i], batch.dz[i] };
+                next.push_back({ Ray(p, direction, color), path.pixel, path.ttl - 1, path.sample, path.radiance,
+                                 next_event && &batch == &batches[DIFFUSE] });
+            }
+        }
+        paths_finished += paths.size() - next.size();
+        std::swap(paths, next);
+    }
+
+    // Sample one light for each hit in the diffuse batch, in a direction
+    // within the cone it covers, and trace shadow rays to see which samples
+    // reach it. The batch's r, g, b already include the albedo, so with the
+    // Lambertian BRDF albedo / pi and the cone's pdf 1 / (2 pi (1 - cos_max)),
+    // a light adds r * emission * cos * 2 (1 - cos_max), times the number of
+    // lights for picking one at random.
+    void sample_lights(const ShadeBatch& batch) {
+        const auto& lights = scene.lights;
+        shadow_rays.clear();
+        for (size_t i = 0; i < batch.size; i++) {
+            const size_t light = std::min(lights.size() - 1, size_t(batch.u2[i] * lights.size()));
+            const Sphere& sphere = lights[light].sphere;
+            const Point3 p { batch.px[i], batch.py[i], batch.pz[i] };
+            const Vec3 n { batch.nx[i], batch.ny[i], batch.nz[i] };
+            const Vec3 to_center = sphere.center - p;
+            const float distance_sq = to_center.sqlen();
+            const float radius_sq = sphere.radius * sphere.radius;
+            if (distance_sq <= radius_sq) {
+                continue;
+            }
+            const float cos_max = std::sqrt(1 - radius_sq / distance_sq);
+            const float cos_theta = 1 - batch.u4[i] * (1 - cos_max);
+            const float sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+            const float phi = float(2 * M_PI) * batch.u5[i];
+            const Vec3 w = to_center / std::sqrt(distance_sq);
+            Vec3 t1, t2;
+            orthonormal_basis(w, t1, t2);
+            const Vec3 direction = sin_theta * std::cos(phi) * t1 + sin_theta * std::sin(phi) * t2 + cos_theta * w;
+            const float cos_n = dot(direction, n);
+            if (cos_n <= 0) {
+                continue;
+            }
+            const float along = dot(to_center, direction);
+            const float distance = along - std::sqrt(std::max(0.0f, radius_sq - (distance_sq - along * along)));
+            const Vec3 color = Vec3(batch.r[i], batch.g[i], batch.b[i]) * lights[light].emission
+                * (cos_n * 2 * (1 - cos_max) * lights.size());
+            shadow_rays.push_back({ Ray(p, direction, Vec3()), distance * 0.999f, batch.path[i], color });
+        }
+        shadow_rays_traced += shadow_rays.size();
+        if constexpr (STATS_ENABLED) {
+            thread_stats().shadow_rays += shadow_rays.size();
+        }
+        for (const ShadowRay& shadow : shadow_rays) {
+            if (!scene.Occluded(shadow.ray, shadow.distance)) {
+                paths[shadow.path].radiance += shadow.color;
+            }
+        }
+    }
+
+    // Random numbers for the batch. Independent samples come straight from
+    // the generator, others from the sampler for the path's current bounce.
+    void fill_random(ShadeBatch& batch, Random& rng) {
+        const bool light_samples = next_event && &batch == &batches[DIFFUSE];
+        if (sampler.get_type() == SamplerType::Independent) {
+            batch.fill_random(rng, light_samples);
+            return;
+        }
+        samples.resize(batch.size);
+        for (size_t i = 0; i < batch.size; i++) {
+            const Path& path = paths[batch.path[i]];
+            samples.set(i, path.sample, BOUNCE_DIM + DIMS_PER_BOUNCE * (max_rays - path.ttl));
+        }
+        sampler.fill(samples, batch.size, 0, batch.u0.data(), batch.u1.data());
+        sampler.fill(samples, batch.size, 2, batch.u2.data(), batch.u3.data());
+        if (light_samples) {
+            sampler.fill(samples, batch.size, 4, batch.u4.data(), batch.u5.data());
+        }
+    }
+
+    // Run each material's batch scatter kernel over its hits.
+    template <size_t... I>
+    void scatter(Random& rng, std::index_sequence<I...>) {
+        ((fill_random(batches[I], rng),
+          std::variant_alternative_t<I, Material>::scatter(batches[I], batches[I].size)), ...);
+    }
+};
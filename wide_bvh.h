@@ -0,0 +1,309 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include "bvh.h"
+
+#ifdef __AVX2__
+constexpr int BVH_WIDTH = 8;
+#else
+constexpr int BVH_WIDTH = 4;
+#endif
+
+template <int W>
+struct SimdFloat;
+
+template <>
+struct SimdFloat<4> {
+    using type = __m128;
+    static type load(const float* p) { return _mm_load_ps(p); }
+    static type loadu(const float* p) { return _mm_loadu_ps(p); }
+    static type set1(float x) { return _mm_set1_ps(x); }
+    static type min(type a, type b) { return _mm_min_ps(a, b); }
+    static type max(type a, type b) { return _mm_max_ps(a, b); }
+    static type sqrt(type a) { return _mm_sqrt_ps(a); }
+    static void store(float* p, type a) { _mm_store_ps(p, a); }
+    // Bitmask of the lanes where a <= b.
+    static int less_equal(type a, type b) { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+    static int less(type a, type b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+};
+
+#ifdef __AVX2__
+template <>
+struct SimdFloat<8> {
+    using type = __m256;
+    static type load(const float* p) { return _mm256_load_ps(p); }
+    static type loadu(const float* p) { return _mm256_loadu_ps(p); }
+    static type set1(float x) { return _mm256_set1_ps(x); }
+    static type min(type a, type b) { return _mm256_min_ps(a, b); }
+    static type max(type a, type b) { return _mm256_max_ps(a, b); }
+    static type sqrt(type a) { return _mm256_sqrt_ps(a); }
+    static void store(float* p, type a) { _mm256_store_ps(p, a); }
+    static int less_equal(type a, type b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+    static int less(type a, type b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+};
+#endif
+
+// W-wide BVH collapsed from a binary BVH. Each node stores the bounds of
+// its children in SoA form so that all of them can be tested at once.
+template <typename T, int W = BVH_WIDTH>
+class WideBVH {
+public:
+    // The root is always node 0, with a single leaf child if the binary
+    // BVH is just a leaf.
+    struct alignas(W * sizeof(float)) Node {
+        float min_x[W], min_y[W], min_z[W];
+        float max_x[W], max_y[W], max_z[W];
+        // Index of the child node, or of the first item for leaf children.
+        uint32_t child[W];
+        // Number of items in leaf children, 0 for interior children.
+        uint16_t count[W];
+        uint8_t size;
+    };
+
+private:
+    using Simd = SimdFloat<W>;
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> indices;
+
+    static constexpr size_t MAX_STACK = 64 * (W - 1) + 1;
+
+    uint32_t collapse(ArrayRef<BVHNode> bin, uint32_t bin_index) {
+        uint32_t children[W];
+        int n = 0;
+        if (bin[bin_index].is_leaf()) {
+            children[n++] = bin_index;
+        } else {
+            children[n++] = bin[bin_index].offset;
+            children[n++] = bin[bin_index].offset + 1;
+        }
+        // Open the largest interior child until the node is full.
+        while (n < W) {
+            int largest = -1;
+            float largest_area = -1;
+            for (int i = 0; i < n; i++) {
+                const BVHNode& child = bin[children[i]];
+                const float area = child.get_bounds().surface_area();
+                if (!child.is_leaf() && area > largest_area) {
+                    largest = i;
+                    largest_area = area;
+                }
+            }
+            if (largest < 0) {
+                break;
+            }
+            const uint32_t offset = bin[children[largest]].offset;
+            children[largest] = offset;
+            children[n++] = offset + 1;
+        }
+
+        const uint32_t index = nodes.size();
+        nodes.emplace_back();
+        uint32_t child_refs[W];
+        for (int i = 0; i < n; i++) {
+            const BVHNode& child = bin[children[i]];
+            child_refs[i] = child.is_leaf() ? child.offset : collapse(bin, children[i]);
+        }
+
+        Node& node = nodes[index];
+        node = Node{};
+        node.size = n;
+        for (int i = 0; i < n; i++) {
+            const BVHNode& child = bin[children[i]];
+            node.min_x[i] = child.min[0];
+            node.min_y[i] = child.min[1];
+            node.min_z[i] = child.min[2];
+            node.max_x[i] = child.max[0];
+            node.max_y[i] = child.max[1];
+            node.max_z[i] = child.max[2];
+            node.child[i] = child_refs[i];
+            node.count[i] = child.count;
+        }
+        return index;
+    }
+
+public:
+    WideBVH() {}
+    WideBVH(const BVH<T>& bvh):
+        indices(bvh.get_indices().begin(), bvh.get_indices().end())
+    {
+        if (!bvh.get_nodes().empty()) {
+            nodes.reserve(bvh.get_nodes().size() / 2 + 1);
+            collapse(bvh.get_nodes(), 0);
+        }
+    }
+
+    const std::vector<Node>& get_nodes() const {
+        return nodes;
+    }
+
+    // The BVH's item indices, in the same order, so that leaf ranges mean
+    // the same in both.
+    const std::vector<uint32_t>& get_indices() const {
+        return indices;
+    }
+
+    // Closest-hit traversal, visiting the children that are hit in order of
+    // entry distance.
+    void intersect(const std::vector<T>& items, const Ray& ray, HitRecord& out) const {
+        traverse(ray, out, [&](uint32_t first, uint32_t count) {
+            for (uint32_t k = first; k < first + count; k++) {
+                items[indices[k]].intersect(ray, out);
+            }
+        });
+    }
+
+    // Any-hit traversal: whether any item is hit closer than tmax. Children
+    // are visited in any order.
+    bool occluded(const std::vector<T>& items, const Ray& ray, float tmax) const {
+        return traverse_any(ray, tmax, [&](uint32_t first, uint32_t count) {
+            for (uint32_t k = first; k < first + count; k++) {
+                if (items[indices[k]].occluded(ray, tmax)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    // Closest-hit traversal that calls leaf(first, count) for each leaf the
+    // ray reaches, with the leaf's range in get_indices(). leaf updates out
+    // with any closer hit.
+    template <typename F>
+    void traverse(const Ray& ray, HitRecord& out, F&& leaf) const {
+        if (nodes.empty()) {
+            return;
+        }
+        const auto ox = Simd::set1(ray.origin.x);
+        const auto oy = Simd::set1(ray.origin.y);
+        const auto oz = Simd::set1(ray.origin.z);
+        const auto idx = Simd::set1(ray.inverted_direction.x);
+        const auto idy = Simd::set1(ray.inverted_direction.y);
+        const auto idz = Simd::set1(ray.inverted_direction.z);
+        const auto zero = Simd::set1(0);
+        auto closest = [&]() {
+            return out.is_hit() ? out.distance : INFINITY;
+        };
+
+        struct Entry {
+            uint32_t index;
+            uint32_t count;
+            float distance;
+        };
+        StatCounter visited(&RenderStats::nodes_visited);
+        StatCounter tested(&RenderStats::primitive_tests);
+        Entry stack[MAX_STACK];
+        size_t sp = 0;
+        stack[sp++] = { 0, 0, 0 };
+        while (sp) {
+            const Entry entry = stack[--sp];
+            if (entry.distance > closest()) {
+                continue;
+            }
+
+            const Node& node = nodes[entry.index];
+            ++visited;
+            const float tmax = closest();
+            const auto t1x = (Simd::load(node.min_x) - ox) * idx;
+            const auto t2x = (Simd::load(node.max_x) - ox) * idx;
+            const auto t1y = (Simd::load(node.min_y) - oy) * idy;
+            const auto t2y = (Simd::load(node.max_y) - oy) * idy;
+            const auto t1z = (Simd::load(node.min_z) - oz) * idz;
+            const auto t2z = (Simd::load(node.max_z) - oz) * idz;
+            const auto tnear = Simd::max(
+                Simd::max(Simd::min(t1x, t2x), Simd::min(t1y, t2y)),
+                Simd::max(Simd::min(t1z, t2z), zero));
+            const auto tfar = Simd::min(
+                Simd::min(Simd::max(t1x, t2x), Simd::max(t1y, t2y)),
+                Simd::min(Simd::max(t1z, t2z), Simd::set1(tmax)));
+            int mask = Simd::less_equal(tnear, tfar) & ((1 << node.size) - 1);
+            alignas(W * sizeof(float)) float distance[W];
+            Simd::store(distance, tnear);
+
+            // Sort the children that were hit, farthest first.
+            Entry hits[W];
+            int n = 0;
+            while (mask) {
+                const int i = __builtin_ctz(mask);
+                mask &= mask - 1;
+                const Entry hit = { node.child[i], node.count[i], distance[i] };
+                int j = n++;
+                for (; j > 0 && hits[j - 1].distance < hit.distance; j--) {
+                    hits[j] = hits[j - 1];
+                }
+                hits[j] = hit;
+            }
+            // Leaf children are intersected right away, nearest first, which
+            // shortens tmax for the interior children before they're popped.
+            for (int i = n - 1; i >= 0; i--) {
+                if (hits[i].count && hits[i].distance <= closest()) {
+                    tested += hits[i].count;
+                    leaf(hits[i].index, hits[i].count);
+                }
+            }
+            for (int i = 0; i < n; i++) {
+                if (!hits[i].count) {
+                    stack[sp++] = hits[i];
+                }
+            }
+        }
+    }
+
+    // Any-hit traversal: calls leaf(first, count) for the leaves the ray
+    // reaches until it returns true, and returns whether it did.
+    template <typename F>
+    bool traverse_any(const Ray& ray, float tmax, F&& leaf) const {
+        if (nodes.empty()) {
+            return false;
+        }
+        const auto ox = Simd::set1(ray.origin.x);
+        const auto oy = Simd::set1(ray.origin.y);
+        const auto oz = Simd::set1(ray.origin.z);
+        const auto idx = Simd::set1(ray.inverted_direction.x);
+        const auto idy = Simd::set1(ray.inverted_direction.y);
+        const auto idz = Simd::set1(ray.inverted_direction.z);
+        const auto zero = Simd::set1(0);
+        const auto far = Simd::set1(tmax);
+
+        StatCounter visited(&RenderStats::nodes_visited);
+        StatCounter tested(&RenderStats::primitive_tests);
+        uint32_t stack[MAX_STACK];
+        size_t sp = 0;
+        stack[sp++] = 0;
+        while (sp) {
+            const Node& node = nodes[stack[--sp]];
+            ++visited;
+            const auto t1x = (Simd::load(node.min_x) - ox) * idx;
+            const auto t2x = (Simd::load(node.max_x) - ox) * idx;
+            const auto t1y = (Simd::load(node.min_y) - oy) * idy;
+            const auto t2y = (Simd::load(node.max_y) - oy) * idy;
+            const auto t1z = (Simd::load(node.min_z) - oz) * idz;
+            const auto t2z = (Simd::load(node.max_z) - oz) * idz;
+            const auto tnear = Simd::max(
+                Simd::max(Simd::min(t1x, t2x), Simd::min(t1y, t2y)),
+                Simd::max(Simd::min(t1z, t2z), zero));
+            const auto tfar = Simd::min(
+                Simd::min(Simd::max(t1x, t2x), Simd::max(t1y, t2y)),
+                Simd::min(Simd::max(t1z, t2z), far));
+            int mask = Simd::less_equal(tnear, tfar) & ((1 << node.size) - 1);
+            while (mask) {
+                const int i = __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (!node.count[i]) {
+                    stack[sp++] = node.child[i];
+                    continue;
+                }
+                tested += node.count[i];
+                if (leaf(node.child[i], node.count[i])) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void dump(std::ostream& os) const {
+        os << "BVH" << W << " " << nodes.size() << " nodes, " << sizeof(Node) << " bytes per node\n";
+    }
+};